@@ -0,0 +1,328 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <frame.h>
+#include <frame_pool.h>
+#include <frame_queue.h>
+#include <synthetic_source.h>
+#include <video_encoder.h>
+#include <yuyv.h>
+#include <logging.h>
+
+
+/*
+ *  Throughput of every pipeline stage on synthetic frames, so it runs
+ *  without a camera. One JSON object per line goes to stdout:
+ *
+ *      bench [-n frames] [stage ...]
+ *
+ *  Stages: capture, deinterleave, frame_alloc, encode, mux (all by default).
+ */
+
+using Clock = std::chrono::steady_clock;
+
+struct Resolution {
+    uint32_t width;
+    uint32_t height;
+};
+
+static const Resolution resolutions[] = {
+    {640, 480},
+    {1280, 720},
+    {1920, 1080},
+};
+
+// Checked for exactness only: widths off the SIMD block size exercise the scalar
+// tails, odd heights the single-row chroma of 4:2:0
+static const Resolution odd_resolutions[] = {
+    {642, 481},
+    {66, 7},
+};
+
+static const char *presets[] = {"ultrafast", "veryfast", "medium", "slow"};
+
+struct Result {
+    std::string stage;
+    std::string variant;
+    Resolution resolution;
+    size_t frames;
+    double seconds;
+    std::string extra;  // already formatted ", \"key\": value" pairs
+
+    void print() const {
+        double pixels = (double)resolution.width * resolution.height * frames;
+        std::printf("{\"stage\": \"%s\", \"variant\": \"%s\", \"width\": %u, \"height\": %u, "
+                    "\"frames\": %zu, \"seconds\": %.6f, \"fps\": %.2f, \"ns_per_pixel\": %.4f%s}\n",
+                    stage.c_str(), variant.c_str(), resolution.width, resolution.height,
+                    frames, seconds, frames / seconds, seconds * 1e9 / pixels, extra.c_str());
+        std::fflush(stdout);
+    }
+};
+
+static double seconds_since(Clock::time_point t0) {
+    return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+
+/*
+ *  Hand-off of leases from a capture thread through the pipeline queue,
+ *  the source itself is free, so this is the queue and wakeup overhead.
+ */
+static void bench_capture(size_t n_frames) {
+    for (const Resolution &r : resolutions) {
+        my::SyntheticSource source(r.width, r.height);
+        source.paced = false;
+        source.start();
+
+        my::FrameQueue<my::FrameLease> queue(2);
+        auto t0 = Clock::now();
+
+        std::thread producer([&] {
+            for (size_t i = 0; i < n_frames; ++i) {
+                if (!queue.push(source.borrow_frame())) break;
+            }
+            queue.close();
+        });
+
+        my::FrameLease lease;
+        size_t received = 0;
+        while (queue.pop(lease)) {
+            lease.release();
+            ++received;
+        }
+        producer.join();
+
+        Result{"capture", "queue", r, received, seconds_since(t0), ""}.print();
+    }
+}
+
+
+static void bench_deinterleave(size_t n_frames) {
+    std::vector<Resolution> sizes(std::begin(resolutions), std::end(resolutions));
+    sizes.insert(sizes.end(), std::begin(odd_resolutions), std::end(odd_resolutions));
+
+    size_t mismatches = 0;
+    for (const Resolution &r : sizes) {
+        my::SyntheticSource source(r.width, r.height, 30, 1);
+        source.paced = false;
+        source.start();
+        my::FrameLease lease = source.borrow_frame();
+
+        // Planes with AVFrame-like padded strides
+        auto align = [] (uint32_t n) { return (int)((n + 63) & ~63u); };
+        int linesize[3] = {align(r.width), align(r.width / 2), align(r.width / 2)};
+        std::vector<uint8_t> reference[3], planes[3];
+        for (int i = 0; i < 3; ++i) {
+            reference[i].assign((size_t)linesize[i] * r.height, 0);
+            planes[i].assign((size_t)linesize[i] * r.height, 0);
+        }
+        uint8_t *const ref_data[3] = {reference[0].data(), reference[1].data(), reference[2].data()};
+        uint8_t *const data[3] = {planes[0].data(), planes[1].data(), planes[2].data()};
+
+        auto kernels = my::yuyv::supported_kernels();
+        for (int chroma = 0; chroma < 2; ++chroma) {
+            const char *format = chroma ? "yuv420p" : "yuv422p";
+
+            auto kernel_of = [chroma] (const my::yuyv::Kernels *k) {
+                return chroma ? k->to_yuv420p : k->to_yuv422p;
+            };
+            // 4:2:0 fills only half the chroma rows, the rest must match the zeroed planes
+            for (auto &plane : reference) std::fill(plane.begin(), plane.end(), 0);
+            kernel_of(kernels.front())(lease.data, r.width * 2, r.width, r.height, ref_data, linesize);
+
+            for (const my::yuyv::Kernels *k : kernels) {
+                auto kernel = kernel_of(k);
+
+                for (auto &plane : planes) std::fill(plane.begin(), plane.end(), 0);
+                kernel(lease.data, r.width * 2, r.width, r.height, data, linesize);
+                bool exact = planes[0] == reference[0] && planes[1] == reference[1] && planes[2] == reference[2];
+                if (!exact) {
+                    LOG_ERROR << k->name << " " << format << " differs from the reference at "
+                              << r.width << "x" << r.height;
+                    mismatches++;
+                }
+
+                auto t0 = Clock::now();
+                for (size_t i = 0; i < n_frames; ++i) {
+                    kernel(lease.data, r.width * 2, r.width, r.height, data, linesize);
+                }
+
+                Result result{"deinterleave", std::string(k->name) + "/" + format, r, n_frames, seconds_since(t0),
+                              std::string(", \"exact\": ") + (exact ? "true" : "false")};
+                result.print();
+            }
+        }
+    }
+
+    if (mismatches) {
+        throw std::runtime_error(std::to_string(mismatches) + " deinterleave kernels differ from the reference");
+    }
+}
+
+
+static void bench_frame_alloc(size_t n_frames) {
+    for (const Resolution &r : resolutions) {
+        my::SyntheticSource source(r.width, r.height, 30, 4);
+        source.paced = false;
+        source.start();
+
+        // A small window of live frames, like the pipeline queue holds
+        const size_t window = 4;
+
+        {
+            std::vector<my::Frame> frames(window);
+            auto t0 = Clock::now();
+            for (size_t i = 0; i < n_frames; ++i) {
+                my::FrameLease lease = source.borrow_frame();
+                frames[i % window] = my::Frame(lease.data, lease.size);
+            }
+            Result{"frame_alloc", "malloc", r, n_frames, seconds_since(t0), ""}.print();
+        }
+
+        {
+            my::FramePool pool(source.format.image_size);
+            std::vector<my::Frame> frames(window);
+            auto t0 = Clock::now();
+            for (size_t i = 0; i < n_frames; ++i) {
+                my::FrameLease lease = source.borrow_frame();
+                frames[i % window] = my::Frame(pool, lease.data, lease.size);
+            }
+            double seconds = seconds_since(t0);
+
+            auto stats = pool.stats();
+            Result{"frame_alloc", "pool", r, n_frames, seconds,
+                   ", \"misses\": " + std::to_string(stats.misses) +
+                   ", \"high_water\": " + std::to_string(stats.high_water)}.print();
+        }
+    }
+}
+
+
+/*
+ *  Encodes n_frames into memory, the packets are kept for the mux stage.
+ */
+static std::vector<AVPacket*> encode(my::VideoEncoder &encoder, my::FrameSource &source,
+                                     const my::EncoderParams &params, size_t n_frames, double &seconds) {
+    encoder.open(params);
+
+    auto t0 = Clock::now();
+    for (size_t i = 0; i < n_frames; ++i) {
+        my::FrameLease lease = source.borrow_frame();
+        encoder.push_frame(lease.data, lease.size, i);
+    }
+    encoder.finish();
+    seconds = seconds_since(t0);
+
+    return encoder.take_packets();
+}
+
+static void free_packets(std::vector<AVPacket*> &packets) {
+    for (AVPacket *packet : packets) av_packet_free(&packet);
+    packets.clear();
+}
+
+
+static void bench_encode(size_t n_frames) {
+    for (const Resolution &r : resolutions) {
+        my::SyntheticSource source(r.width, r.height);
+        source.paced = false;
+        source.start();
+
+        for (const char *preset : presets) {
+            my::EncoderParams params = my::EncoderParams::from_source(source);
+            params.preset = preset;
+
+            double seconds = 0;
+            my::VideoEncoder encoder;
+            auto packets = encode(encoder, source, params, n_frames, seconds);
+
+            size_t bytes = 0;
+            for (AVPacket *packet : packets) bytes += packet->size;
+            free_packets(packets);
+
+            Result{"encode", preset, r, n_frames, seconds, ", \"bytes\": " + std::to_string(bytes)}.print();
+        }
+    }
+}
+
+
+static void bench_mux(size_t n_frames) {
+    const char *filename = "/tmp/timelapser-bench.mp4";
+
+    for (const Resolution &r : resolutions) {
+        my::SyntheticSource source(r.width, r.height);
+        source.paced = false;
+        source.start();
+
+        my::EncoderParams params = my::EncoderParams::from_source(source);
+        params.preset = "ultrafast";
+
+        double encode_seconds = 0;
+        my::VideoEncoder encoder;
+        auto packets = encode(encoder, source, params, n_frames, encode_seconds);
+
+        // Mux only, the stream takes the encoder's parameters and no codec is opened or flushed
+        my::VideoEncoder muxer;
+        muxer.open(filename, encoder);
+
+        size_t bytes = 0;
+        auto t0 = Clock::now();
+        for (AVPacket *packet : packets) {
+            bytes += packet->size;
+            muxer.write_packet(packet);
+        }
+        muxer.finish();
+        double seconds = seconds_since(t0);
+
+        free_packets(packets);
+        std::remove(filename);
+
+        Result{"mux", "mp4", r, n_frames, seconds, ", \"bytes\": " + std::to_string(bytes)}.print();
+    }
+}
+
+
+int main(int argc, char **argv) {
+    Log::GlobalContext::instance()
+        .set_level(Log::Level::Warning)
+        .attach(std::cerr);
+
+    size_t n_frames = 100;
+    std::vector<std::string> stages;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n_frames = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            stages.push_back(argv[i]);
+        }
+    }
+
+    auto enabled = [&stages] (const char *stage) {
+        if (stages.empty()) return true;
+        for (auto &s : stages) if (s == stage) return true;
+        return false;
+    };
+
+    try {
+        if (enabled("capture"))      bench_capture(n_frames * 10);
+        if (enabled("deinterleave")) bench_deinterleave(n_frames);
+        if (enabled("frame_alloc"))  bench_frame_alloc(n_frames * 10);
+        if (enabled("encode"))       bench_encode(n_frames);
+        if (enabled("mux"))          bench_mux(n_frames);
+    } catch (const std::exception &e) {
+        LOG_ERROR << e.what();
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
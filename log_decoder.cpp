@@ -0,0 +1,132 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <logging.h>
+#include <handler.h>
+
+
+/*
+ *  Prints a log written by Log::BinaryHandler as the text handlers would:
+ *
+ *      log_decoder file.tlog
+ */
+
+using Definitions = std::unordered_map<uint64_t, std::string>;
+
+static std::string_view resolve(uint64_t id, const void *user) {
+    auto &definitions = *static_cast<const Definitions*>(user);
+    auto it = definitions.find(id);
+    return it == definitions.end() ? std::string_view("<?>") : std::string_view(it->second);
+}
+
+static bool varint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+    return Log::binary::take_varint(p, end, value);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <binary log>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        std::perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(Log::binary::magic)) {
+        std::cerr << argv[1] << ": not a binary log" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        std::perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    const uint8_t *p = static_cast<const uint8_t*>(map);
+    const uint8_t *end = p + size;
+    if (std::memcmp(p, Log::binary::magic, sizeof(Log::binary::magic)) != 0) {
+        std::cerr << argv[1] << ": not a binary log" << std::endl;
+        return EXIT_FAILURE;
+    }
+    p += sizeof(Log::binary::magic);
+
+    Definitions definitions;
+    Log::Args args;
+    int64_t time = 0;
+    char message[Log::max_message];
+    char line[Log::max_message + 128];
+    size_t events = 0;
+    bool broken = false;
+    const uint8_t *record = p;
+
+    while (p < end) {
+        record = p;
+        uint8_t kind = *p++;
+
+        if (kind == Log::binary::Definition) {
+            uint64_t id, length;
+            if (!varint(p, end, id) || !varint(p, end, length) || (uint64_t)(end - p) < length) {
+                broken = true;
+                break;
+            }
+
+            definitions[id].assign(reinterpret_cast<const char*>(p), length);
+            p += length;
+        } else if ((kind & 0x0f) == Log::binary::Event) {
+            uint64_t delta, thread, context, args_size;
+            if (!varint(p, end, delta) || !varint(p, end, thread) || !varint(p, end, context) ||
+                !varint(p, end, args_size) ||
+                (uint64_t)(end - p) < args_size || !Log::binary::expand(p, args_size, args)) {
+                broken = true;
+                break;
+            }
+            p += args_size;
+            time += Log::binary::unzigzag(delta);
+
+            size_t length = Log::render(args.data, args.size, message, sizeof(message), resolve, &definitions);
+
+            auto it = definitions.find(context);
+            const char *context_name = it == definitions.end() ? nullptr : it->second.c_str();
+
+            std::chrono::system_clock::time_point timestamp{
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(time))};
+            size_t line_size = Log::format_line(line, sizeof(line), timestamp, static_cast<Log::Level>(kind >> 4),
+                                                thread, context_name, std::string_view(message, length));
+
+            std::cout.write(line, line_size).put('\n');
+            ++events;
+        } else {
+            // Zeroed tail of a log that was not closed, anything else is garbage
+            broken = kind != 0;
+            break;
+        }
+    }
+
+    if (broken) {
+        std::cerr << argv[1] << ": stopped at a broken record, offset "
+                  << (record - static_cast<const uint8_t*>(map)) << std::endl;
+    }
+
+    munmap(map, size);
+    close(fd);
+
+    std::cerr << events << " events" << std::endl;
+    return 0;
+}
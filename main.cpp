@@ -1,12 +1,21 @@
 #include <iostream>
 #include <fstream>
 #include <cstdio>
-#include <vector>
+#include <string>
+#include <cstdlib>
 #include <chrono>
-#include <thread>
+#include <memory>
+#include <vector>
+#include <algorithm>
 
 #include <webcamera.h>
+#include <synthetic_source.h>
+#include <file_source.h>
 #include <video_encoder.h>
+#include <pipeline.h>
+#include <segment_renderer.h>
+#include <camera_group.h>
+#include <metrics.h>
 #include <logging.h>
 
 
@@ -17,45 +26,171 @@ void save_image(const my::Frame &frame, const std::string &filename) {
     out.close();
 }
 
+// Driver buffers per camera, enough to ride out an encoder stall of a few frames
+static const size_t capture_buffers = 8;
+
+/*
+ *  Source spec is a V4L2 device ("/dev/video0[:WxH][:read|mmap|userptr]"),
+ *  "synthetic[:WxH]" or a raw YUYV file "path:WxH". A camera gets the
+ *  largest mode up to WxH that delivers a frame at least every interval
+ *  seconds (0 for the native rate).
+ */
+std::unique_ptr<my::FrameSource> open_source(const std::string &spec, double interval) {
+    uint32_t width = 640, height = 480;
+
+    std::string name = spec;
+    auto colon = spec.rfind(':');
+
+    if (spec.compare(0, 10, "/dev/video") == 0) {
+        my::CameraSpec camera_spec = my::parse_camera_spec(spec);
+        if (interval > 0) {
+            camera_spec.requirements.interval_numerator = interval * 1000;
+            camera_spec.requirements.interval_denominator = 1000;
+        }
+
+        auto camera = new my::WebCamera;
+        std::unique_ptr<my::FrameSource> source(camera);
+        camera->open(camera_spec.device.c_str());
+        camera->auto_configure(camera_spec.requirements);
+        camera->init_buffers(capture_buffers, camera_spec.io);
+        return source;
+    }
+
+    if (colon != std::string::npos) {
+        name = spec.substr(0, colon);
+        if (std::sscanf(spec.c_str() + colon + 1, "%ux%u", &width, &height) != 2) {
+            throw std::runtime_error("Bad resolution in source " + spec);
+        }
+    }
+
+    if (name == "synthetic") {
+        return std::unique_ptr<my::FrameSource>(new my::SyntheticSource(width, height));
+    }
+
+    // A timelapse of a file has to see it play at its frame rate, not as fast as it can be read
+    auto file = new my::FileSource(name.c_str(), width, height);
+    file->paced = interval > 0;
+    return std::unique_ptr<my::FrameSource>(file);
+}
+
 int main(int argc, char **argv) {
     try {
         Log::GlobalContext::instance()
             .set_level(Log::Level::Debug)
-            .attach(std::cout);
+            .attach(std::cout)
+            .start_async();
 
-        my::WebCamera camera;
-        camera.open("/dev/video0");
-        camera.init_buffers(2);
-        camera.start();
+        /*
+         *  timelapser [options] [interval in seconds, 0 for native rate] [number of frames]
+         *             [source[,source...]] [metrics file]
+         *
+         *      -c codec     encoder name as in ffmpeg -c:v (libx264)
+         *      -p preset    codec speed/size preset (medium)
+         *      -q crf       constant quality (23)
+         *      -b bit_rate  average bits per second instead of constant quality
+         *      -t threads   codec threads, 0 lets the codec decide
+         *      -T frame|slice  threading, frames for throughput, slices for latency
+         */
+        my::EncoderParams settings;
+        settings.rate_control = my::EncoderParams::RateControl::CRF;
+        settings.preset = "medium";
 
-        std::vector<my::Frame> frames;
-        frames.reserve(5000);
+        std::vector<std::string> args;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.size() != 2 || arg[0] != '-') {
+                args.push_back(arg);
+                continue;
+            }
+            if (i + 1 == argc) throw std::runtime_error("Option " + arg + " needs a value");
+            std::string value = argv[++i];
 
-        my::VideoEncoder encoder;
-        encoder.find_codec("H264");
+            switch (arg[1]) {
+                case 'c': settings.codec = value; break;
+                case 'p': settings.preset = value; break;
+                case 'q':
+                    settings.rate_control = my::EncoderParams::RateControl::CRF;
+                    settings.crf = std::atoi(value.c_str());
+                    break;
+                case 'b':
+                    settings.rate_control = my::EncoderParams::RateControl::Bitrate;
+                    settings.bit_rate = std::atoll(value.c_str());
+                    break;
+                case 't': settings.thread_count = std::atoi(value.c_str()); break;
+                case 'T':
+                    if (value == "frame") settings.threading = my::EncoderParams::Threading::Frame;
+                    else if (value == "slice") settings.threading = my::EncoderParams::Threading::Slice;
+                    else throw std::runtime_error("Unknown threading " + value);
+                    break;
+                default:
+                    throw std::runtime_error("Unknown option " + arg);
+            }
+        }
 
-        int n = 50;
-        LOG_DEBUG << "Going to get " << n << " frames video";
-        auto t0 = std::chrono::steady_clock::now();
-        for (int i = 0; i < n; ++i) {
-            auto frame = camera.get_frame();
-            frames.push_back(std::move(frame));
-            // std::this_thread::sleep_for(std::chrono::microseconds(100));
+        std::unique_ptr<my::metrics::Dumper> metrics;
+        if (args.size() > 3) {
+            metrics.reset(new my::metrics::Dumper(args[3], std::chrono::seconds(5)));
+        }
+
+        int n = args.size() > 1 ? std::atoi(args[1].c_str()) : 50;
+        std::string spec = args.size() > 2 ? args[2] : "/dev/video0";
 
-            // save_image(frame, "data/webcam" + std::to_string(i) + ".jpg");
+        double interval = args.size() > 0 ? std::atof(args[0].c_str()) : 0;
 
-            if ((i + 1) % 10 == 0) {
-                LOG_DEBUG << "Progress " << (i + 1) * 100.0 / n << "%";
+        // Several devices separated by commas are captured together, one file per camera
+        if (spec.find(',') != std::string::npos) {
+            std::vector<std::string> devices;
+            for (size_t begin = 0, end; begin <= spec.size(); begin = end + 1) {
+                end = std::min(spec.find(',', begin), spec.size());
+                if (end > begin) devices.push_back(spec.substr(begin, end - begin));
             }
+
+            my::CameraGroup group(devices, capture_buffers, 4,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(interval)));
+            group.encoder_params = settings;
+            group.run(n, "data/camera");
+            return 0;
         }
+
+        auto source = open_source(spec, interval);
+        source->start();
+
+        my::EncoderParams params = my::EncoderParams::from_source(*source, settings);
+        // pts come from capture timestamps, a timelapse plays one shot per frame
+        params.variable_frame_rate = true;
+        if (interval > 0) params.capture_interval_ns = interval * 1e9;
+
+        // A timelapse from an MJPEG camera keeps the JPEGs, a tenth of the raw size, and renders at the end
+        std::vector<my::Frame> archive;
+        bool render_later = interval > 0 && my::is_compressed(source->format.pixel_format);
+
+        my::VideoEncoder encoder;
+        if (!render_later) encoder.open("data/output.mp4", params);
+
+        my::Pipeline pipeline(*source, encoder);
+        if (render_later) pipeline.archive = &archive;
+
+        std::unique_ptr<my::IntervalScheduler> scheduler;
+        if (interval > 0) {
+            scheduler.reset(new my::IntervalScheduler(
+                *source, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(interval))));
+            pipeline.scheduler = scheduler.get();
+        }
+
+        LOG_DEBUG << "Going to get " << n << " frames video";
+        auto t0 = std::chrono::steady_clock::now();
+        pipeline.run(n);
         auto t1 = std::chrono::steady_clock::now();
 
-        camera.stop();
+        source->stop();
+        if (render_later) {
+            my::SegmentRenderer().render(archive, "data/output.mp4", params);
+        } else {
+            encoder.finish();
+        }
 
         LOG_DEBUG << "Filming was made in "
-                  << std::chrono::duration_cast<microseconds>(t1 - t0).count << " microseconds";
-
-        // encoder.render(frames);
+                  << std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() << " microseconds";
     } catch (const std::exception& e) {
         LOG_ERROR << e.what();
         exit(EXIT_FAILURE);
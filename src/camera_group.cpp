@@ -0,0 +1,155 @@
+#include <camera_group.h>
+#include <logging.h>
+
+#include <linux/videodev2.h>
+
+#include <exception>
+#include <stdexcept>
+
+
+namespace my {
+
+CameraGroup::Camera::Camera(uint32_t id, const std::string &device, size_t queue_depth)
+    : id(id)
+    , device(device)
+    , queue(queue_depth)
+{}
+
+
+CameraGroup::CameraGroup(const std::vector<std::string> &devices, size_t buffers, size_t queue_depth,
+                         std::chrono::nanoseconds interval)
+    : interval(interval)
+{
+    if (devices.empty()) {
+        throw std::runtime_error("Camera group needs at least one device");
+    }
+
+    for (const std::string &device : devices) {
+        CameraSpec spec = parse_camera_spec(device);
+
+        std::unique_ptr<Camera> camera(new Camera(cameras.size(), spec.device, queue_depth));
+        camera->camera.id = camera->id;
+        camera->camera.open(spec.device.c_str(), true);
+
+        // Cameras may share a bus, so each gets an equal share of it
+        WebCamera::Requirements &requirements = spec.requirements;
+        requirements.bandwidth /= devices.size();
+        if (interval.count() > 0) {
+            requirements.interval_numerator = std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+            requirements.interval_denominator = 1000;
+        }
+        requirements.pixel_formats = {V4L2_PIX_FMT_YUYV};
+        camera->camera.auto_configure(requirements);
+
+        // Leases go to the encoder as they are, MJPEG would need a decoder per camera
+        if (camera->camera.format.pixel_format != V4L2_PIX_FMT_YUYV) {
+            throw std::runtime_error("Camera group captures only YUYV, " + spec.device + " delivers another format");
+        }
+        camera->camera.init_buffers(buffers, spec.io);
+        cameras.push_back(std::move(camera));
+    }
+}
+
+void CameraGroup::run(size_t n_frames, const std::string &output_prefix) {
+    std::vector<std::thread> encoders;
+    std::vector<std::exception_ptr> errors(cameras.size());
+
+    auto close_all = [this, &encoders] {
+        for (auto &camera : cameras) camera->queue.close();
+        for (auto &thread : encoders) thread.join();
+        encoders.clear();
+    };
+
+    try {
+        for (auto &camera : cameras) {
+            Camera *c = camera.get();
+
+            EncoderParams params = EncoderParams::from_source(c->camera, encoder_params);
+            params.variable_frame_rate = true;
+            if (interval.count() > 0) params.capture_interval_ns = interval.count();
+            c->encoder.open((output_prefix + std::to_string(c->id) + ".mp4").c_str(), params);
+
+            encoders.emplace_back([this, c, &errors] {
+                try {
+                    PtsClock clock(c->encoder.params);
+                    FrameLease lease;
+                    while (c->queue.pop(lease)) {
+                        c->encoder.push_frame(lease.data, lease.size, clock.next(lease.timestamp_ns));
+                        lease.release();
+                    }
+                } catch (...) {
+                    errors[c->id] = std::current_exception();
+                    c->queue.close();
+                    reactor.stop();
+                }
+            });
+        }
+
+        size_t done = 0;
+        for (auto &camera : cameras) {
+            Camera *c = camera.get();
+
+            c->camera.watch(reactor, [this, c, n_frames, &done] (FrameLease lease) {
+                if (c->captured >= n_frames) return;
+
+                if (c->captured + c->dropped > 0 && lease.sequence > c->last_sequence + 1) {
+                    c->lost += lease.sequence - c->last_sequence - 1;
+                }
+                c->last_sequence = lease.sequence;
+
+                if (!c->shot_due) return;
+
+                if (!c->queue.try_push(std::move(lease))) {
+                    ++c->dropped;
+                    return;
+                }
+
+                c->shot_due = interval.count() == 0;
+
+                if (++c->captured == n_frames) {
+                    reactor.remove(c->camera.descriptor);
+                    c->camera.stop();
+                    c->queue.close();
+                    if (++done == cameras.size()) reactor.stop();
+                }
+            });
+            c->camera.start();
+        }
+
+        // Every tick makes the next frame of each camera a shot
+        int timer = -1;
+        if (interval.count() > 0) {
+            timer = reactor.add_timer(interval, [this] (uint64_t) {
+                for (auto &camera : cameras) camera->shot_due = true;
+            });
+        }
+
+        LOG_DEBUG << "Capturing " << n_frames << " frames from " << cameras.size() << " cameras";
+        reactor.run();
+        if (timer >= 0) reactor.remove(timer);
+    } catch (...) {
+        for (auto &camera : cameras) reactor.remove(camera->camera.descriptor);
+        close_all();
+        throw;
+    }
+
+    for (auto &camera : cameras) {
+        if (camera->camera.state != FrameSource::State::StreamON) continue;  // stopped at its last frame
+        reactor.remove(camera->camera.descriptor);
+        camera->camera.stop();
+    }
+    close_all();
+
+    for (auto &error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+
+    for (auto &camera : cameras) {
+        camera->encoder.finish();
+        LOG_INFO << "Camera " << camera->id << " (" << camera->device << "): "
+                 << camera->captured << " frames, " << camera->dropped << " dropped, "
+                 << camera->lost << " lost by the driver";
+    }
+}
+
+}
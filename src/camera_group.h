@@ -0,0 +1,63 @@
+#pragma once
+
+#include <frame_queue.h>
+#include <frame_source.h>
+#include <reactor.h>
+#include <video_encoder.h>
+#include <webcamera.h>
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace my {
+
+/*
+ *  Several cameras captured by one reactor thread, each with its own
+ *  encoder thread, so a host scales with cameras instead of processes.
+ *
+ *  The reactor never blocks on an encoder: when a camera's queue is full
+ *  the frame goes straight back to the driver and is counted as dropped.
+ *  Queued frames are leases on driver buffers, so queue_depth should stay
+ *  below the number of buffers each camera gets.
+ *
+ *  Devices are specs as parse_camera_spec() takes them. With an interval a
+ *  reactor timer fires one shot per camera every interval, the frames in
+ *  between go straight back to the driver. A camera that has all its
+ *  frames leaves the reactor and stops streaming.
+ */
+struct CameraGroup {
+    struct Camera {
+        uint32_t id;
+        std::string device;
+        WebCamera camera;
+        VideoEncoder encoder;
+        FrameQueue<FrameLease> queue;
+
+        size_t captured{0};
+        size_t dropped{0};   // queue was full
+        size_t lost{0};      // never captured, from gaps in the driver sequence
+        uint32_t last_sequence{0};
+        bool shot_due{true};  // the next frame is a shot, set by the interval timer
+
+        Camera(uint32_t id, const std::string &device, size_t queue_depth);
+    };
+
+    std::vector<std::unique_ptr<Camera>> cameras;
+    Reactor reactor;
+    std::chrono::nanoseconds interval;  // zero for every frame
+    EncoderParams encoder_params;       // codec settings, size and time base come from each camera
+
+    CameraGroup(const std::vector<std::string> &devices, size_t buffers = 8, size_t queue_depth = 4,
+                std::chrono::nanoseconds interval = std::chrono::nanoseconds::zero());
+    CameraGroup(const CameraGroup &) = delete;
+
+    /* Captures n_frames from every camera into <output_prefix><id>.mp4 */
+    void run(size_t n_frames, const std::string &output_prefix);
+};
+
+}
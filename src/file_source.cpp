@@ -0,0 +1,110 @@
+#include <file_source.h>
+#include <logging.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+
+namespace my {
+
+FileSource::FileSource(const char *path, uint32_t width, uint32_t height, uint32_t fps) {
+    if (width == 0 || height == 0 || width % 2 || fps == 0) {
+        throw std::runtime_error("Invalid file source parameters");
+    }
+
+    format.width = width;
+    format.height = height;
+    format.pixel_format = V4L2_PIX_FMT_YUYV;
+    format.bytes_per_line = width * 2;
+    format.image_size = width * height * 2;
+    format.interval_numerator = 1;
+    format.interval_denominator = fps;
+
+    interval = std::chrono::nanoseconds(1000000000LL / fps);
+
+    descriptor = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (descriptor < 0) {
+        throw std::runtime_error("Cannot open " + std::string(path));
+    }
+
+    // The destructor does not run for a constructor that throws
+    auto fail = [this] (const std::string &message) {
+        close(descriptor);
+        descriptor = -1;
+        throw std::runtime_error(message);
+    };
+
+    struct stat st{};
+    if (fstat(descriptor, &st) < 0) {
+        fail("Cannot stat " + std::string(path));
+    }
+
+    n_frames = st.st_size / format.image_size;
+    if (n_frames == 0) {
+        fail(std::string(path) + " holds less than one frame");
+    }
+
+    mapping_size = n_frames * format.image_size;
+    void *memory = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    if (memory == MAP_FAILED) {
+        fail("Cannot mmap " + std::string(path));
+    }
+    mapping = (const uint8_t*) memory;
+
+    frame_pool.set_buffer_size(format.image_size);
+
+    LOG_DEBUG << "File source " << path << ": " << n_frames << " frames "
+              << width << "x" << height << " @ " << fps << " fps";
+}
+
+FileSource::~FileSource() {
+    if (mapping) munmap((void*)mapping, mapping_size);
+    if (descriptor >= 0) close(descriptor);
+}
+
+void FileSource::start() {
+    next_due = std::chrono::steady_clock::now();
+    state = State::StreamON;
+}
+
+void FileSource::stop() {
+    state = State::StreamOFF;
+}
+
+FrameLease FileSource::borrow_frame() {
+    if (state != State::StreamON) {
+        throw std::runtime_error("File source is not started");
+    }
+
+    if (next == n_frames) {
+        if (!loop) throw std::runtime_error("File source reached the end of file");
+        next = 0;
+    }
+
+    if (paced) {
+        std::this_thread::sleep_until(next_due);
+
+        auto now = std::chrono::steady_clock::now();
+        next_due = now > next_due + interval ? now : next_due + interval;
+    }
+
+    size_t index = next++;
+    // Files pass 4 GiB after a thousand 1080p frames, the offset must not wrap
+    return FrameLease(this, index, mapping + index * format.image_size, format.image_size);
+}
+
+bool FileSource::frame_ready() {
+    if (state != State::StreamON || (!loop && next == n_frames)) return false;
+    return !paced || std::chrono::steady_clock::now() >= next_due;
+}
+
+void FileSource::requeue(uint32_t) {}
+
+}
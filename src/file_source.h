@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <frame_source.h>
+
+
+namespace my {
+
+/*
+ *  Replays a raw YUYV file (frames of width * height * 2 bytes back to
+ *  back, e.g. dumped with save_image()) as if it came from a camera.
+ *  The file is mmap'ed, leases point straight into it.
+ */
+struct FileSource : FrameSource {
+    bool paced{false};  // deliver at the format's frame rate
+    bool loop{true};    // start over at the end of the file
+
+    FileSource(const char *path, uint32_t width, uint32_t height, uint32_t fps = 30);
+    FileSource(const FileSource &) = delete;
+    ~FileSource() override;
+
+    void start() override;
+    void stop() override;
+
+    FrameLease borrow_frame() override;
+    bool frame_ready() override;
+    void requeue(uint32_t index) override;
+
+    size_t frame_count() const { return n_frames; }
+
+private:
+    int descriptor{-1};
+    const uint8_t *mapping{nullptr};
+    size_t mapping_size{0};
+    size_t n_frames{0};
+    size_t next{0};
+
+    std::chrono::nanoseconds interval;
+    std::chrono::steady_clock::time_point next_due;
+};
+
+}
@@ -1,37 +1,109 @@
 #include <frame.h>
+#include <frame_pool.h>
 #include <logging.h>
+#include <linux/videodev2.h>
 #include <cstring>
+#include <cstdlib>
+#include <stdexcept>
 
 
 namespace my {
 
-Frame::Frame(uint8_t *data_, size_t size_) {
-    data = (uint8_t*) malloc(size_);
-    size = size_;
+bool is_compressed(uint32_t pixel_format) {
+    return pixel_format == V4L2_PIX_FMT_MJPEG || pixel_format == V4L2_PIX_FMT_JPEG;
+}
 
-    memcpy(data, data_, size_);
+
+Frame::Frame(const uint8_t *data_, size_t size_) {
+    assign(nullptr, data_, size_);
 }
 
 
-Frame::Frame(const Frame &other) {
-    data = (uint8_t*) malloc(other.size);
-    size = other.size;
+Frame::Frame(FramePool &pool_, const uint8_t *data_, size_t size_) {
+    assign(&pool_, data_, size_);
+}
 
-    memcpy(data, other.data, other.size);
+
+Frame::Frame(const Frame &other) {
+    assign(other.pool, other.data, other.size);
+    pixel_format = other.pixel_format;
+    timestamp_ns = other.timestamp_ns;
+    sequence = other.sequence;
 }
 
 
 Frame::Frame(Frame &&other) {
     data = other.data;
     size = other.size;
+    pool = other.pool;
+    pixel_format = other.pixel_format;
+    timestamp_ns = other.timestamp_ns;
+    sequence = other.sequence;
 
     other.data = nullptr;
     other.size = 0;
+    other.pool = nullptr;
 }
 
 
 Frame::~Frame() {
-    if (data) free(data);
+    reset();
+}
+
+
+Frame &Frame::operator=(Frame &&other) {
+    if (this == &other) return *this;
+    reset();
+
+    data = other.data;
+    size = other.size;
+    pool = other.pool;
+    pixel_format = other.pixel_format;
+    timestamp_ns = other.timestamp_ns;
+    sequence = other.sequence;
+
+    other.data = nullptr;
+    other.size = 0;
+    other.pool = nullptr;
+
+    return *this;
+}
+
+
+Frame Frame::adopt(FramePool *pool_, uint8_t *data_, size_t size_) {
+    Frame frame;
+    frame.data = data_;
+    frame.size = size_;
+    frame.pool = pool_;
+    return frame;
+}
+
+
+void Frame::assign(FramePool *pool_, const uint8_t *data_, size_t size_) {
+    // Frames larger than the pool's buffers fall back to the heap
+    if (pool_) data = pool_->acquire(size_);
+    pool = data ? pool_ : nullptr;
+
+    if (data == nullptr) {
+        data = (uint8_t*) malloc(size_);
+        if (data == nullptr && size_ > 0) throw std::runtime_error("Out of memory for frame");
+    }
+
+    size = size_;
+    memcpy(data, data_, size_);
+}
+
+
+void Frame::reset() {
+    if (pool) {
+        pool->release(data);
+    } else if (data) {
+        free(data);
+    }
+
+    data = nullptr;
+    size = 0;
+    pool = nullptr;
 }
 
 }
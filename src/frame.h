@@ -6,14 +6,37 @@
 
 namespace my {
 
+struct FramePool;
+
+/* True for V4L2 fourccs whose frames are a compressed payload, not pixels */
+bool is_compressed(uint32_t pixel_format);
+
 struct Frame {
     uint8_t *data{nullptr};
     size_t size{0};
+    FramePool *pool{nullptr};  // owner of data, heap if nullptr
+    uint32_t pixel_format{0};  // V4L2 fourcc of data, 0 if unknown
+    int64_t timestamp_ns{0};   // capture time, CLOCK_MONOTONIC; 0 if unknown
+    uint32_t sequence{0};      // driver frame counter, gaps are dropped frames
 
-    Frame(uint8_t *data, size_t size);
+    Frame() = default;
+    Frame(const uint8_t *data, size_t size);
+    Frame(FramePool &pool, const uint8_t *data, size_t size);
     Frame(const Frame &);
     Frame(Frame &&);
     ~Frame();
+
+    Frame &operator=(Frame &&);
+
+    // MJPEG frames stay compressed until an encoder needs the pixels
+    bool compressed() const { return is_compressed(pixel_format); }
+
+    // Takes ownership of data without copying, it must come from pool (from malloc if nullptr)
+    static Frame adopt(FramePool *pool, uint8_t *data, size_t size);
+
+private:
+    void assign(FramePool *pool, const uint8_t *data, size_t size);
+    void reset();
 };
 
 }
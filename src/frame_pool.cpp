@@ -0,0 +1,98 @@
+#include <frame_pool.h>
+#include <logging.h>
+
+#include <cstdlib>
+#include <stdexcept>
+
+
+namespace my {
+
+FramePool::FramePool(size_t buffer_size, size_t preallocate) {
+    set_buffer_size(buffer_size, preallocate);
+}
+
+FramePool::~FramePool() {
+    if (counters.in_use > 0) {
+        LOG_ERROR << "Frame pool destroyed with " << counters.in_use << " buffers still in use";
+    }
+
+    clear();
+}
+
+void FramePool::set_buffer_size(size_t size, size_t preallocate, size_t alignment_) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (counters.in_use > 0) {
+        throw std::runtime_error("Cannot resize frame pool while its buffers are in use");
+    }
+
+    clear();
+    alignment = alignment_;
+    capacity = (size + alignment - 1) / alignment * alignment;
+
+    free_list.reserve(preallocate);
+    for (size_t i = 0; i < preallocate; ++i) {
+        free_list.push_back(allocate());
+    }
+}
+
+size_t FramePool::buffer_size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return capacity;
+}
+
+uint8_t *FramePool::acquire(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (capacity == 0 || size > capacity) {
+        counters.oversized++;
+        return nullptr;
+    }
+
+    uint8_t *buffer = nullptr;
+    if (free_list.empty()) {
+        counters.misses++;
+        buffer = allocate();
+    } else {
+        counters.hits++;
+        buffer = free_list.back();
+        free_list.pop_back();
+    }
+
+    counters.in_use++;
+    if (counters.in_use > counters.high_water) counters.high_water = counters.in_use;
+
+    return buffer;
+}
+
+void FramePool::release(uint8_t *buffer) {
+    if (buffer == nullptr) return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.in_use--;
+    free_list.push_back(buffer);
+}
+
+FramePool::Stats FramePool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+uint8_t *FramePool::allocate() {
+    auto *buffer = (uint8_t*) aligned_alloc(alignment, capacity);
+    if (buffer == nullptr) {
+        throw std::runtime_error("Out of memory for frame pool buffer");
+    }
+
+    counters.allocated++;
+    return buffer;
+}
+
+void FramePool::clear() {
+    for (uint8_t *buffer : free_list) free(buffer);
+
+    counters.allocated -= free_list.size();
+    free_list.clear();
+}
+
+}
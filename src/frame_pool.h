@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+
+
+namespace my {
+
+/*
+ *  Recycles fixed-size, aligned frame buffers, so once the pool has
+ *  warmed up capture does not touch the heap at all. Buffers are 64-byte
+ *  aligned for SIMD, or page aligned when a driver captures into them.
+ *
+ *  Buffers are handed out by acquire() and come back with release(),
+ *  both may be called from different threads. The pool must outlive
+ *  every buffer it gave away.
+ */
+struct FramePool {
+    static constexpr size_t default_alignment = 64;
+
+    struct Stats {
+        size_t allocated{0};   // buffers owned by the pool
+        size_t in_use{0};      // buffers currently handed out
+        size_t high_water{0};  // max in_use ever seen
+        size_t hits{0};        // acquires served from the free list
+        size_t misses{0};      // acquires that had to allocate
+        size_t oversized{0};   // requests larger than buffer_size, not served
+    };
+
+    explicit FramePool(size_t buffer_size = 0, size_t preallocate = 0);
+    FramePool(const FramePool &) = delete;
+    ~FramePool();
+
+    void set_buffer_size(size_t size, size_t preallocate = 0, size_t alignment = default_alignment);
+    size_t buffer_size() const;
+
+    uint8_t *acquire(size_t size);
+    void release(uint8_t *buffer);
+
+    Stats stats() const;
+
+private:
+    size_t capacity{0};
+    size_t alignment{default_alignment};
+    std::vector<uint8_t*> free_list;
+    Stats counters;
+
+    mutable std::mutex mutex;
+
+    uint8_t *allocate();
+    void clear();
+};
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace my {
+
+/*
+ *  Fixed-depth blocking queue between the capture and the encode thread.
+ *
+ *  push() blocks while the queue is full, so a slow consumer throttles the
+ *  producer instead of letting memory grow. After close() pushes are rejected
+ *  and pop() drains whatever is left, then returns false.
+ */
+template <typename T>
+struct FrameQueue {
+    explicit FrameQueue(size_t depth) : depth(depth) {}
+    FrameQueue(const FrameQueue &) = delete;
+
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return closed || items.size() < depth; });
+        if (closed) return false;
+
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Never blocks, false if the queue is full or closed
+    bool try_push(T &&item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed || items.size() >= depth) return false;
+
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+    size_t capacity() const { return depth; }
+
+private:
+    const size_t depth;
+    bool closed = false;
+    std::deque<T> items;
+
+    mutable std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+}
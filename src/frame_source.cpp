@@ -0,0 +1,94 @@
+#include <frame_source.h>
+#include <logging.h>
+
+#include <stdexcept>
+
+
+namespace my {
+
+FrameLease::FrameLease(FrameSource *source, uint32_t index, const uint8_t *data, size_t size)
+    : source(source)
+    , index(index)
+    , data(data)
+    , size(size)
+{}
+
+FrameLease::FrameLease(FrameLease &&other) {
+    source = other.source;
+    index = other.index;
+    data = other.data;
+    size = other.size;
+    device = other.device;
+    timestamp_ns = other.timestamp_ns;
+    sequence = other.sequence;
+
+    other.source = nullptr;
+    other.data = nullptr;
+    other.size = 0;
+}
+
+FrameLease::~FrameLease() {
+    try {
+        release();
+    } catch (const std::exception &e) {
+        LOG_ERROR << e.what();
+    }
+}
+
+FrameLease &FrameLease::operator=(FrameLease &&other) {
+    if (this == &other) return *this;
+    release();
+
+    source = other.source;
+    index = other.index;
+    data = other.data;
+    size = other.size;
+    device = other.device;
+    timestamp_ns = other.timestamp_ns;
+    sequence = other.sequence;
+
+    other.source = nullptr;
+    other.data = nullptr;
+    other.size = 0;
+
+    return *this;
+}
+
+void FrameLease::release() {
+    if (source == nullptr) return;
+
+    FrameSource *owner = source;
+    source = nullptr;
+    data = nullptr;
+    size = 0;
+
+    owner->requeue(index);
+}
+
+
+bool FrameSource::try_borrow(FrameLease &lease) {
+    if (!frame_ready()) return false;
+
+    lease = borrow_frame();
+    return true;
+}
+
+Frame FrameSource::take(FrameLease &&lease) {
+    FrameLease held = std::move(lease);
+
+    // Pool buffers fit the largest image, a JPEG keeps only its payload
+    Frame frame = is_compressed(format.pixel_format)
+        ? Frame(held.data, held.size)
+        : Frame(frame_pool, held.data, held.size);
+
+    frame.pixel_format = format.pixel_format;
+    frame.timestamp_ns = held.timestamp_ns;
+    frame.sequence = held.sequence;
+    return frame;
+}
+
+Frame FrameSource::get_frame() {
+    return take(borrow_frame());
+}
+
+}
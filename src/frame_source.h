@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <frame.h>
+#include <frame_pool.h>
+
+
+namespace my {
+
+struct FrameSource;
+
+/*
+ *  What the source agreed to deliver. Pixel format is a V4L2 fourcc,
+ *  time per frame is a fraction of a second, like v4l2_fract.
+ */
+struct Format {
+    uint32_t width{0};
+    uint32_t height{0};
+    uint32_t pixel_format{0};
+    uint32_t bytes_per_line{0};
+    uint32_t image_size{0};
+    uint32_t interval_numerator{1};
+    uint32_t interval_denominator{30};
+};
+
+/*
+ *  Frame lent to the consumer by a FrameSource. The data belongs to the
+ *  source (for a camera it is the mmap'ed driver buffer) and goes back to
+ *  it only when the lease is released or destroyed.
+ */
+struct FrameLease {
+    FrameSource *source{nullptr};
+    uint32_t index{0};
+    const uint8_t *data{nullptr};
+    size_t size{0};
+
+    uint32_t device{0};        // which source of a group it came from
+    int64_t timestamp_ns{0};   // capture time from the driver, CLOCK_MONOTONIC; 0 if unknown
+    uint32_t sequence{0};      // driver frame counter, gaps are frames the driver dropped
+
+    FrameLease() = default;
+    FrameLease(FrameSource *source, uint32_t index, const uint8_t *data, size_t size);
+    FrameLease(const FrameLease&) = delete;
+    FrameLease(FrameLease&&);
+    ~FrameLease();
+
+    FrameLease &operator=(FrameLease&&);
+    explicit operator bool() const { return source != nullptr; }
+
+    void release();
+};
+
+/*
+ *  Anything frames can be captured from: a camera, a generator, a file.
+ *  Everything downstream of capture works with this interface only.
+ */
+struct FrameSource {
+    enum class State {
+        StreamOFF,
+        StreamON,
+    };
+
+    Format format;
+    State state = State::StreamOFF;
+
+    // Backs frames returned by get_frame(), sized to the negotiated image
+    FramePool frame_pool;
+
+    virtual ~FrameSource() = default;
+
+    virtual void start() = 0;
+    virtual void stop() = 0;
+
+    // Blocks until a frame is available
+    virtual FrameLease borrow_frame() = 0;
+    // True if borrow_frame() would not block
+    virtual bool frame_ready() = 0;
+    // Takes a frame only if one is ready
+    virtual bool try_borrow(FrameLease &lease);
+    // Called by FrameLease::release()
+    virtual void requeue(uint32_t index) = 0;
+    // Most frames the source holds ready at once, so at most this many can be stale
+    virtual size_t buffer_count() const { return 1; }
+
+    // Turns a lease into a Frame the caller owns, by default a copy into frame_pool
+    // or, for compressed formats, onto the heap at the payload's size
+    virtual Frame take(FrameLease &&lease);
+    Frame get_frame();
+};
+
+}
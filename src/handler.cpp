@@ -1,5 +1,12 @@
 #include "handler.h"
-#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 
 namespace Log {
@@ -11,8 +18,11 @@ FileHandler::FileHandler(const char *filename, Level handler_level)
     level = handler_level;
 }
 
-void FileHandler::write(const std::stringstream &log) {
-    output << log.str() << '\n';
+void FileHandler::write(std::string_view line) {
+    output.write(line.data(), line.size()).put('\n');
+}
+
+void FileHandler::flush() {
     output.flush();
 }
 
@@ -22,9 +32,233 @@ StreamHandler::StreamHandler(std::ostream &stream, Level handler_level)
     level = handler_level;
 }
 
-void StreamHandler::write(const std::stringstream &log) {
-    output << log.str() << '\n';
+void StreamHandler::write(std::string_view line) {
+    output.write(line.data(), line.size()).put('\n');
+}
+
+void StreamHandler::flush() {
     output.flush();
 }
 
+constexpr size_t BinaryHandler::chunk;
+
+BinaryHandler::BinaryHandler(const char *filename, Level handler_level) {
+    level = handler_level;
+
+    descriptor = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (descriptor < 0) throw std::runtime_error("Cannot open log file!");
+
+    std::memcpy(reserve(sizeof(binary::magic)), binary::magic, sizeof(binary::magic));
+}
+
+BinaryHandler::~BinaryHandler() {
+    if (map) munmap(map, mapped);
+    if (descriptor >= 0) {
+        // Cut the unused tail of the last chunk
+        if (ftruncate(descriptor, used) < 0) {}
+        close(descriptor);
+    }
+}
+
+/* Room for size more bytes, the file grows by whole chunks */
+uint8_t *BinaryHandler::reserve(size_t size) {
+    if (used + size > mapped) {
+        size_t new_size = mapped + std::max(chunk, size);
+        if (ftruncate(descriptor, new_size) < 0) {
+            throw std::runtime_error("Cannot grow log file");
+        }
+
+        void *new_map = map ? mremap(map, mapped, new_size, MREMAP_MAYMOVE)
+                            : mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+        if (new_map == MAP_FAILED) {
+            throw std::runtime_error("Cannot map log file");
+        }
+
+        map = static_cast<uint8_t*>(new_map);
+        mapped = new_size;
+    }
+
+    uint8_t *p = map + used;
+    used += size;
+    return p;
+}
+
+/* LEB128, 7 bits per byte, low bits first */
+static uint8_t *put_varint(uint8_t *p, uint64_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+bool binary::take_varint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t binary::unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static const size_t max_varint = 10;
+
+uint64_t BinaryHandler::define(const char *text) {
+    auto inserted = ids.emplace(reinterpret_cast<uintptr_t>(text), ids.size() + 1);
+    uint64_t id = inserted.first->second;
+    if (!inserted.second) return id;
+
+    size_t length = std::strlen(text);
+    uint8_t *p = reserve(1 + 2 * max_varint + length);
+    uint8_t *start = p;
+    *p++ = binary::Definition;
+    p = put_varint(p, id);
+    p = put_varint(p, length);
+    std::memcpy(p, text, length);
+    p += length;
+
+    used -= (start + 1 + 2 * max_varint + length) - p;  // give back unused varint room
+    return id;
+}
+
+void BinaryHandler::write_record(const Record &record) {
+    uint64_t context = record.context.name ? define(record.context.name) : 0;
+
+    // Compact the arguments first, defining new literals on the way
+    uint8_t args[max_message * 2];
+    uint8_t *out = args;
+
+    const uint8_t *p = record.args.data;
+    const uint8_t *end = p + record.args.size;
+    while (p < end) {
+        uint8_t type = *p++;
+        *out++ = type;
+
+        switch (type) {
+        case Args::Literal: {
+            uint64_t address;
+            std::memcpy(&address, p, sizeof(address));
+            p += sizeof(address);
+            out = put_varint(out, define(reinterpret_cast<const char*>(address)));
+            break;
+        }
+        case Args::String: {
+            uint16_t n;
+            std::memcpy(&n, p, sizeof(n));
+            p += sizeof(n);
+            out = put_varint(out, n);
+            std::memcpy(out, p, n);
+            out += n;
+            p += n;
+            break;
+        }
+        case Args::Int: {
+            int64_t value;
+            std::memcpy(&value, p, sizeof(value));
+            p += sizeof(value);
+            out = put_varint(out, zigzag(value));
+            break;
+        }
+        case Args::UInt:
+        case Args::Pointer: {
+            uint64_t value;
+            std::memcpy(&value, p, sizeof(value));
+            p += sizeof(value);
+            out = put_varint(out, value);
+            break;
+        }
+        case Args::Double:
+            std::memcpy(out, p, sizeof(double));
+            out += sizeof(double);
+            p += sizeof(double);
+            break;
+        case Args::Char:
+            *out++ = *p++;
+            break;
+        }
+    }
+
+    int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count();
+    size_t size = out - args;
+
+    uint8_t *start = reserve(1 + 4 * max_varint + size);
+    uint8_t *q = start;
+    *q++ = binary::Event | (uint8_t)record.level << 4;
+    q = put_varint(q, zigzag(time - last_time));
+    q = put_varint(q, record.thread);
+    q = put_varint(q, context);
+    q = put_varint(q, size);
+    std::memcpy(q, args, size);
+    q += size;
+
+    used -= (start + 1 + 4 * max_varint + size) - q;
+    last_time = time;
+}
+
+void BinaryHandler::flush() {
+    if (map) msync(map, used, MS_ASYNC);
+}
+
+
+bool binary::expand(const uint8_t *data, size_t size, Args &args) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    args.size = 0;
+
+    while (p < end) {
+        uint8_t type = *p++;
+        uint64_t value;
+
+        switch (type) {
+        case Args::Literal:
+            if (!binary::take_varint(p, end, value)) return false;
+            args.literal(reinterpret_cast<const char*>(value));
+            break;
+        case Args::String:
+            if (!binary::take_varint(p, end, value) || (uint64_t)(end - p) < value) return false;
+            args.string(std::string_view(reinterpret_cast<const char*>(p), value));
+            p += value;
+            break;
+        case Args::Int:
+            if (!binary::take_varint(p, end, value)) return false;
+            args.integer(binary::unzigzag(value));
+            break;
+        case Args::UInt:
+            if (!binary::take_varint(p, end, value)) return false;
+            args.uinteger(value);
+            break;
+        case Args::Pointer:
+            if (!binary::take_varint(p, end, value)) return false;
+            args.pointer(reinterpret_cast<const void*>(value));
+            break;
+        case Args::Double: {
+            double d;
+            if ((size_t)(end - p) < sizeof(d)) return false;
+            std::memcpy(&d, p, sizeof(d));
+            p += sizeof(d);
+            args.floating(d);
+            break;
+        }
+        case Args::Char:
+            if (p == end) return false;
+            args.character(*p++);
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
 }
@@ -2,27 +2,97 @@
 #define GIR1_HANDLER_H
 
 #include <fstream>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
 #include "logging.h"
 
 namespace Log {
 
 struct Handler {
     Level level = Level::Debug;
-    virtual void write(const std::stringstream& log) = 0;
+    std::mutex mutex;  // held by GlobalContext around write() and flush()
+
+    virtual ~Handler() = default;
+    virtual void write(std::string_view line) = 0;
+    virtual void flush() = 0;
+
+    /* Structured handlers get the record instead of the formatted line */
+    virtual bool structured() const { return false; }
+    virtual void write_record(const Record &) {}
 };
 
 struct FileHandler : public Handler {
     std::ofstream output;
 
     explicit FileHandler(const char *filename, Level handler_level = Level::Debug);
-    void write(const std::stringstream& log) override;
+    void write(std::string_view line) override;
+    void flush() override;
 };
 
 struct StreamHandler : public Handler {
     std::ostream &output;
 
     explicit StreamHandler(std::ostream &stream, Level handler_level = Level::Debug);
-    void write(const std::stringstream& log) override;
+    void write(std::string_view line) override;
+    void flush() override;
+};
+
+/*
+ *  Binary log, decoded to text by log_decoder. After the magic the file is
+ *  a sequence of records, numbers are LEB128 varints:
+ *
+ *      Definition: kind, id, length, text
+ *      Event:      kind | level << 4, time delta (ns, zigzag), thread id,
+ *                  context id (0 - none), args size, args
+ *
+ *  Args are compacted Log::Args: the same type bytes, but literals refer
+ *  to definitions by id and integers are varints. Strings are defined once
+ *  per file, before the first event using them. The file is mapped and
+ *  grown in chunks, zero bytes after the last record mean end of log.
+ */
+namespace binary {
+
+constexpr char magic[8] = {'T', 'L', 'L', 'O', 'G', 'B', 'N', '2'};
+
+enum Kind : uint8_t {
+    Definition = 1,
+    Event = 2,
+};
+
+bool take_varint(const uint8_t *&p, const uint8_t *end, uint64_t &value);
+int64_t unzigzag(uint64_t value);
+
+/* Turns compacted arguments back into Args, literal ids stay file ids */
+bool expand(const uint8_t *data, size_t size, Args &args);
+
+}
+
+struct BinaryHandler : public Handler {
+    static constexpr size_t chunk = 16 << 20;
+
+    int descriptor = -1;
+    uint8_t *map = nullptr;
+    size_t mapped = 0;
+    size_t used = 0;
+
+    // Address of a literal -> its id in the file
+    std::unordered_map<uint64_t, uint64_t> ids;
+    int64_t last_time = 0;
+
+    explicit BinaryHandler(const char *filename, Level handler_level = Level::Debug);
+    BinaryHandler(const BinaryHandler&) = delete;
+    ~BinaryHandler() override;
+
+    void write(std::string_view) override {}
+    void flush() override;
+
+    bool structured() const override { return true; }
+    void write_record(const Record &record) override;
+
+private:
+    uint64_t define(const char *text);
+    uint8_t *reserve(size_t size);
 };
 
 }
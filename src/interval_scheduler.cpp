@@ -0,0 +1,201 @@
+#include <interval_scheduler.h>
+#include <logging.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+
+namespace my {
+
+static int64_t to_ns(const timespec &t) {
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static timespec from_ns(int64_t ns) {
+    timespec t;
+    t.tv_sec = ns / 1000000000LL;
+    t.tv_nsec = ns % 1000000000LL;
+    return t;
+}
+
+static int64_t monotonic_now_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return to_ns(now);
+}
+
+
+IntervalScheduler::IntervalScheduler(FrameSource &source, std::chrono::nanoseconds interval)
+    : source(source)
+    , interval(interval)
+{
+    if (interval.count() <= 0) {
+        throw std::runtime_error("Capture interval must be positive");
+    }
+
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer < 0) {
+        throw std::runtime_error("Cannot create capture timer");
+    }
+
+    wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup < 0) {
+        close(timer);
+        throw std::runtime_error("Cannot create capture wakeup event");
+    }
+}
+
+IntervalScheduler::~IntervalScheduler() {
+    if (timer >= 0) close(timer);
+    if (wakeup >= 0) close(wakeup);
+
+    if (stats.shots > 0) {
+        LOG_INFO << "Interval capture: " << stats.shots << " shots, "
+                 << stats.missed << " missed, " << stats.drained << " stale frames dropped";
+        if (stats.restarts > 0) {
+            LOG_INFO << "Stream restarted " << stats.restarts << " times, "
+                     << (int64_t)stats.start_latency_ns / 1000 << "us to first frame";
+        }
+        LOG_INFO << "Wake-up jitter: min " << stats.min_jitter_ns / 1000
+                 << "us, max " << stats.max_jitter_ns / 1000
+                 << "us, mean " << (int64_t)stats.mean_jitter_ns / 1000 << "us";
+    }
+}
+
+void IntervalScheduler::start() {
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    tick = 0;
+    running = true;
+    stats = Stats();
+}
+
+void IntervalScheduler::cancel() {
+    cancelled = true;
+
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0) {
+        LOG_ERROR << "Cannot wake the capture scheduler";
+    }
+}
+
+/* False if cancel() came first */
+bool IntervalScheduler::wait_until(int64_t ns) {
+    if (cancelled) return false;
+    if (monotonic_now_ns() >= ns) return true;
+
+    itimerspec spec{};
+    spec.it_value = from_ns(ns);
+
+    if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+        throw std::runtime_error("Cannot arm capture timer");
+    }
+
+    pollfd fds[2] = {{timer, POLLIN, 0}, {wakeup, POLLIN, 0}};
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) throw std::runtime_error("Cannot wait for capture timer");
+    }
+    if (fds[1].revents & POLLIN) return false;
+
+    uint64_t expirations = 0;
+    if (read(timer, &expirations, sizeof(expirations)) < 0) {
+        throw std::runtime_error("Cannot read capture timer");
+    }
+    return true;
+}
+
+size_t IntervalScheduler::drain() {
+    size_t dropped = 0;
+
+    // Only what was queued before the deadline is stale, anything after that is fresh
+    size_t limit = source.buffer_count();
+    while (dropped < limit && source.frame_ready()) {
+        source.borrow_frame().release();
+        dropped++;
+    }
+
+    return dropped;
+}
+
+FrameLease IntervalScheduler::restart_and_shoot() {
+    int64_t started = monotonic_now_ns();
+    source.start();
+
+    for (size_t i = 0; i < warmup_frames; ++i) {
+        source.borrow_frame().release();
+    }
+    FrameLease lease = source.borrow_frame();
+
+    // The buffer stays mapped after STREAMOFF, the lease remains valid
+    source.stop();
+
+    double latency = monotonic_now_ns() - started;
+    stats.restarts++;
+    stats.start_latency_ns += (latency - stats.start_latency_ns) / stats.restarts;
+
+    return lease;
+}
+
+FrameLease IntervalScheduler::next_shot() {
+    if (cancelled) return FrameLease();
+    if (!running) start();
+
+    // Skip deadlines that already passed instead of firing a burst to catch up
+    int64_t now = monotonic_now_ns();
+    int64_t due = (now - to_ns(epoch)) / interval.count();
+    if (due > tick) {
+        stats.missed += due - tick;
+        LOG_WARNING << "Capture is " << (due - tick) << " shots behind schedule";
+        tick = due;
+    }
+
+    int64_t deadline = to_ns(epoch) + tick * interval.count();
+    tick++;
+
+    FrameLease lease;
+    int64_t woke = 0;
+    int64_t target = deadline;
+
+    if (interval > stream_off_threshold) {
+        if (source.state == FrameSource::State::StreamON) source.stop();
+
+        // Pre-arm the stream so the first usable frame lands on the deadline
+        target = deadline - (int64_t)stats.start_latency_ns;
+        if (!wait_until(target)) return FrameLease();
+        woke = monotonic_now_ns();
+
+        lease = restart_and_shoot();
+    } else {
+        if (source.state != FrameSource::State::StreamON) source.start();
+
+        if (!wait_until(deadline)) return FrameLease();
+        woke = monotonic_now_ns();
+
+        stats.drained += drain();
+        lease = source.borrow_frame();
+    }
+
+    int64_t delivered = monotonic_now_ns();
+    int64_t jitter = woke - target;
+    double n = ++stats.shots;
+    if (n == 1) {
+        stats.min_jitter_ns = stats.max_jitter_ns = jitter;
+    } else {
+        stats.min_jitter_ns = std::min(stats.min_jitter_ns, jitter);
+        stats.max_jitter_ns = std::max(stats.max_jitter_ns, jitter);
+    }
+    stats.mean_jitter_ns += (jitter - stats.mean_jitter_ns) / n;
+    stats.mean_delay_ns += ((delivered - deadline) - stats.mean_delay_ns) / n;
+
+    LOG_DEBUG << LOG_LIT("Shot ") << stats.shots << LOG_LIT(" taken ")
+              << (delivered - deadline) / 1000 << LOG_LIT("us after deadline");
+
+    return lease;
+}
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <frame_source.h>
+
+
+namespace my {
+
+/*
+ *  Fires one shot every `interval` for timelapse capture.
+ *
+ *  Deadlines are absolute (start + k * interval on CLOCK_MONOTONIC), so
+ *  lateness of one shot never shifts the following ones. The thread sleeps
+ *  in a timerfd between shots. Before every shot the buffers the driver
+ *  filled in the meantime are dropped, so the delivered frame is captured
+ *  after the deadline, not up to `buffers` frames before it. At most
+ *  buffer_count() frames are dropped, an unpaced source is always ready.
+ *
+ *  For intervals longer than stream_off_threshold the source is stopped
+ *  between shots. It is started again ahead of the deadline by the measured
+ *  start-to-first-frame latency, and the first warmup_frames frames, taken
+ *  while exposure settles, are thrown away.
+ */
+struct IntervalScheduler {
+    struct Stats {
+        size_t shots{0};
+        size_t missed{0};         // deadlines skipped because a shot overran
+        size_t drained{0};        // stale frames thrown away
+        int64_t min_jitter_ns{0}; // wake-up time minus deadline
+        int64_t max_jitter_ns{0};
+        double mean_jitter_ns{0};
+        double mean_delay_ns{0};  // frame delivered minus deadline
+        size_t restarts{0};       // stream started for a shot
+        double start_latency_ns{0};  // stream start to first usable frame
+    };
+
+    FrameSource &source;
+    std::chrono::nanoseconds interval;
+    std::chrono::nanoseconds stream_off_threshold{std::chrono::seconds(10)};
+    size_t warmup_frames{3};
+    Stats stats;
+
+    IntervalScheduler(FrameSource &source, std::chrono::nanoseconds interval);
+    IntervalScheduler(const IntervalScheduler &) = delete;
+    ~IntervalScheduler();
+
+    void start();
+    // Empty lease once cancelled
+    FrameLease next_shot();
+    // Wakes a next_shot() waiting for its deadline, safe from any thread
+    void cancel();
+
+private:
+    int timer{-1};
+    int wakeup{-1};  // eventfd written by cancel()
+    std::atomic<bool> cancelled{false};
+    bool running{false};
+    timespec epoch{};
+    int64_t tick{0};
+
+    bool wait_until(int64_t ns);
+    size_t drain();
+    FrameLease restart_and_shoot();
+};
+
+}
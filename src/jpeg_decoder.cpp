@@ -0,0 +1,199 @@
+#include <jpeg_decoder.h>
+#include <logging.h>
+#include <metrics.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace my {
+
+struct DecoderMetrics {
+    metrics::Histogram &decode = metrics::registry().histogram(
+        "timelapser_decoder_decode_seconds", "MJPEG decode per frame");
+    metrics::Counter &frames = metrics::registry().counter(
+        "timelapser_decoder_frames_total", "MJPEG frames decoded");
+    metrics::Counter &corrupt = metrics::registry().counter(
+        "timelapser_decoder_corrupt_frames_total", "MJPEG frames the decoder rejected");
+};
+
+static DecoderMetrics &decoder_metrics() {
+    static DecoderMetrics instance;
+    return instance;
+}
+
+
+DecodedFrame::DecodedFrame(DecodedFrame &&other) {
+    frame = other.frame;
+    pts = other.pts;
+
+    other.frame = nullptr;
+}
+
+DecodedFrame::~DecodedFrame() {
+    av_frame_free(&frame);
+}
+
+DecodedFrame &DecodedFrame::operator=(DecodedFrame &&other) {
+    if (this == &other) return *this;
+    av_frame_free(&frame);
+
+    frame = other.frame;
+    pts = other.pts;
+
+    other.frame = nullptr;
+    return *this;
+}
+
+
+JpegContext::JpegContext() {
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+    if (codec == nullptr) {
+        throw std::runtime_error("Could not find MJPEG decoder");
+    }
+
+    context = avcodec_alloc_context3(codec);
+    packet = av_packet_alloc();
+    if (context == nullptr || packet == nullptr) {
+        avcodec_free_context(&context);
+        av_packet_free(&packet);
+        throw std::runtime_error("Could not allocate MJPEG decoder");
+    }
+
+    // Frames decode independently, parallelism comes from running several contexts
+    context->thread_count = 1;
+    if (avcodec_open2(context, codec, nullptr) < 0) {
+        avcodec_free_context(&context);
+        av_packet_free(&packet);
+        throw std::runtime_error("Could not open MJPEG decoder");
+    }
+}
+
+JpegContext::~JpegContext() {
+    avcodec_free_context(&context);
+    av_packet_free(&packet);
+}
+
+bool JpegContext::decode(const uint8_t *data, size_t size, AVFrame *picture) {
+    int err;
+    {
+        metrics::ScopedTimer timer(decoder_metrics().decode);
+
+        // The packet borrows the caller's buffer, libavcodec copies what it keeps
+        packet->data = const_cast<uint8_t*>(data);
+        packet->size = size;
+
+        err = avcodec_send_packet(context, packet);
+        if (err >= 0) err = avcodec_receive_frame(context, picture);
+
+        packet->data = nullptr;
+        packet->size = 0;
+    }
+
+    if (err < 0) {
+        decoder_metrics().corrupt.add();
+        return false;
+    }
+
+    decoder_metrics().frames.add();
+    return true;
+}
+
+
+JpegDecoder::JpegDecoder(size_t threads, size_t depth_) {
+    if (threads == 0) {
+        threads = std::min<size_t>(4, std::max(1u, std::thread::hardware_concurrency()));
+    }
+    depth = depth_ ? depth_ : threads + 2;
+
+    for (size_t i = 0; i < threads; ++i) {
+        contexts.emplace_back(new JpegContext);
+    }
+
+    for (auto &context : contexts) {
+        JpegContext *worker_context = context.get();
+        workers.emplace_back([this, worker_context] { work(*worker_context); });
+    }
+
+    LOG_DEBUG << "MJPEG decoder started, " << threads << " threads, depth " << depth;
+}
+
+JpegDecoder::~JpegDecoder() {
+    close();
+    for (auto &worker : workers) worker.join();
+}
+
+bool JpegDecoder::push(FrameLease &&lease, int64_t pts) {
+    std::unique_lock<std::mutex> lock(mutex);
+    has_room.wait(lock, [this] { return closed || pushed - popped < depth; });
+    if (closed) return false;
+
+    Job job;
+    job.sequence = pushed++;
+    job.lease = std::move(lease);
+    job.pts = pts;
+
+    jobs.push_back(std::move(job));
+    has_job.notify_one();
+    return true;
+}
+
+bool JpegDecoder::pop(DecodedFrame &decoded) {
+    std::unique_lock<std::mutex> lock(mutex);
+    has_result.wait(lock, [this] { return done.count(popped) || (closed && popped == pushed); });
+
+    auto next = done.find(popped);
+    if (next == done.end()) return false;
+
+    decoded = std::move(next->second);
+    done.erase(next);
+    ++popped;
+
+    has_room.notify_one();
+    return true;
+}
+
+void JpegDecoder::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    has_room.notify_all();
+    has_job.notify_all();
+    has_result.notify_all();
+}
+
+void JpegDecoder::work(JpegContext &context) {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            has_job.wait(lock, [this] { return closed || !jobs.empty(); });
+            if (jobs.empty()) break;
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        DecodedFrame decoded;
+        decoded.pts = job.pts;
+        decoded.frame = av_frame_alloc();
+
+        if (decoded.frame && !context.decode(job.lease.data, job.lease.size, decoded.frame)) {
+            LOG_WARNING << "Cannot decode MJPEG frame " << job.pts;
+            av_frame_free(&decoded.frame);
+        }
+
+        try {
+            job.lease.release();
+        } catch (const std::exception &e) {
+            LOG_ERROR << e.what();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done.emplace(job.sequence, std::move(decoded));
+        }
+        has_result.notify_all();
+    }
+}
+
+}
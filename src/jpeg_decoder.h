@@ -0,0 +1,99 @@
+#pragma once
+
+#include <frame_source.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+
+namespace my {
+
+/* Decoded picture with the pts it was pushed with, owns the AVFrame */
+struct DecodedFrame {
+    AVFrame *frame{nullptr};  // nullptr if the JPEG could not be decoded
+    int64_t pts{0};
+
+    DecodedFrame() = default;
+    DecodedFrame(const DecodedFrame &) = delete;
+    DecodedFrame(DecodedFrame &&);
+    ~DecodedFrame();
+
+    DecodedFrame &operator=(DecodedFrame &&);
+};
+
+/* MJPEG codec context that decodes one JPEG at a time on the calling thread */
+struct JpegContext {
+    JpegContext();
+    JpegContext(const JpegContext &) = delete;
+    ~JpegContext();
+
+    // False, and counted as corrupt, if the JPEG cannot be decoded into picture
+    bool decode(const uint8_t *data, size_t size, AVFrame *picture);
+
+private:
+    AVCodecContext *context{nullptr};
+    AVPacket *packet{nullptr};
+};
+
+/*
+ *  Decodes MJPEG frames on a pool of worker threads while capture goes on.
+ *
+ *  Every JPEG is a key frame, so each worker has a codec context of its own
+ *  and frames decode independently; pop() still hands them out in the order
+ *  they were pushed. A lease goes back to the driver as soon as its JPEG is
+ *  decoded. push() blocks while depth frames are in flight, so depth has to
+ *  stay below the number of capture buffers.
+ *
+ *  After close() pushes are rejected, frames already pushed are decoded and
+ *  pop() returns false once they are all out.
+ */
+struct JpegDecoder {
+    // 0 threads is one per core up to 4, 0 depth is two more than threads
+    explicit JpegDecoder(size_t threads = 0, size_t depth = 0);
+    JpegDecoder(const JpegDecoder &) = delete;
+    ~JpegDecoder();
+
+    bool push(FrameLease &&lease, int64_t pts);
+    bool pop(DecodedFrame &decoded);
+    void close();
+
+    size_t threads() const { return workers.size(); }
+    size_t capacity() const { return depth; }
+
+private:
+    struct Job {
+        uint64_t sequence{0};
+        FrameLease lease;
+        int64_t pts{0};
+    };
+
+    size_t depth;
+    bool closed = false;
+    uint64_t pushed = 0;  // sequence the next push gets
+    uint64_t popped = 0;  // sequence pop() hands out next
+    std::deque<Job> jobs;
+    std::map<uint64_t, DecodedFrame> done;
+
+    std::mutex mutex;
+    std::condition_variable has_room;
+    std::condition_variable has_job;
+    std::condition_variable has_result;
+
+    std::vector<std::unique_ptr<JpegContext>> contexts;
+    std::vector<std::thread> workers;
+
+    void work(JpegContext &context);
+};
+
+}
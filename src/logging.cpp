@@ -1,8 +1,18 @@
 #include "logging.h"
 #include "handler.h"
+#include "mpsc_ring.h"
 #include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
-#include <iomanip>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 
 namespace Log {
 
@@ -13,7 +23,159 @@ LocalContext::LocalContext(const char *name) noexcept : name(name) {}
 Log::Log(LocalContext ctx) : context(ctx) {}
 
 Log::~Log() {
-    GlobalContext::instance().write(log, level, context);
+    GlobalContext::instance().write(args, level, context);
+}
+
+
+bool Args::put(Type type, const void *value, size_t value_size) {
+    if (full || size + 1 + value_size > max_message) {
+        full = true;  // keep the order, nothing after it is kept either
+        return false;
+    }
+
+    data[size++] = type;
+    std::memcpy(data + size, value, value_size);
+    size += value_size;
+    return true;
+}
+
+void Args::literal(const char *text) {
+    uint64_t id = reinterpret_cast<uintptr_t>(text);
+    put(Literal, &id, sizeof(id));
+}
+
+void Args::string(std::string_view text) {
+    if (full || size + 1 + sizeof(uint16_t) > max_message) {
+        full = true;
+        return;
+    }
+
+    uint16_t length = std::min(text.size(), max_message - size - 1 - sizeof(uint16_t));
+    full = length < text.size();
+    data[size++] = String;
+    std::memcpy(data + size, &length, sizeof(length));
+    std::memcpy(data + size + sizeof(length), text.data(), length);
+    size += sizeof(length) + length;
+}
+
+void Args::integer(int64_t value) {
+    put(Int, &value, sizeof(value));
+}
+
+void Args::uinteger(uint64_t value) {
+    put(UInt, &value, sizeof(value));
+}
+
+void Args::floating(double value) {
+    put(Double, &value, sizeof(value));
+}
+
+void Args::character(char value) {
+    put(Char, &value, sizeof(value));
+}
+
+void Args::pointer(const void *value) {
+    uint64_t address = reinterpret_cast<uintptr_t>(value);
+    put(Pointer, &address, sizeof(address));
+}
+
+
+template <typename T>
+static T read_raw(const uint8_t *&p) {
+    T value;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+}
+
+static size_t raw_size(uint8_t type) {
+    switch (type) {
+    case Args::Literal:
+    case Args::UInt:
+    case Args::Pointer: return sizeof(uint64_t);
+    case Args::Int: return sizeof(int64_t);
+    case Args::Double: return sizeof(double);
+    case Args::Char: return sizeof(char);
+    case Args::String: return sizeof(uint16_t);
+    default: return 0;
+    }
+}
+
+size_t render(const uint8_t *args, size_t size, char *out, size_t out_size,
+              LiteralResolver resolve, const void *user) {
+    const uint8_t *p = args;
+    const uint8_t *end = args + size;
+    size_t length = 0;
+
+    auto append = [&] (std::string_view text) {
+        size_t n = std::min(text.size(), out_size - length);
+        std::memcpy(out + length, text.data(), n);
+        length += n;
+    };
+
+    char number[32];
+    auto append_number = [&] (int n) {
+        if (n > 0) append(std::string_view(number, std::min<size_t>(n, sizeof(number) - 1)));
+    };
+
+    while (p < end && length < out_size) {
+        uint8_t type = *p++;
+
+        // A broken file must not make the decoder read past the record
+        size_t need = raw_size(type);
+        if (need == 0 || (size_t)(end - p) < need) break;
+
+        switch (type) {
+        case Args::Literal: {
+            uint64_t id = read_raw<uint64_t>(p);
+            append(resolve ? resolve(id, user) : std::string_view(reinterpret_cast<const char*>(id)));
+            break;
+        }
+        case Args::String: {
+            uint16_t n = read_raw<uint16_t>(p);
+            if ((size_t)(end - p) < n) return length;
+            append(std::string_view(reinterpret_cast<const char*>(p), n));
+            p += n;
+            break;
+        }
+        case Args::Int:
+            append_number(std::snprintf(number, sizeof(number), "%lld", (long long)read_raw<int64_t>(p)));
+            break;
+        case Args::UInt:
+            append_number(std::snprintf(number, sizeof(number), "%llu", (unsigned long long)read_raw<uint64_t>(p)));
+            break;
+        case Args::Double:
+            append_number(std::snprintf(number, sizeof(number), "%g", read_raw<double>(p)));
+            break;
+        case Args::Char:
+            append(std::string_view(reinterpret_cast<const char*>(p), 1));
+            p += 1;
+            break;
+        case Args::Pointer:
+            append_number(std::snprintf(number, sizeof(number), "0x%llx", (unsigned long long)read_raw<uint64_t>(p)));
+            break;
+        }
+    }
+
+    return length;
+}
+
+
+struct ScratchStream {
+    LineBuffer buffer;
+    std::ostream stream{&buffer};
+};
+
+static thread_local ScratchStream scratch;
+
+std::ostream &scratch_stream() {
+    scratch.buffer.clear();
+    scratch.stream.clear();
+    return scratch.stream;
+}
+
+std::string_view scratch_text() {
+    return scratch.buffer.view();
 }
 
 Log &Log::error() {
@@ -46,50 +208,302 @@ const char *log_level_to_cstr(Level level) {
     }
 }
 
+uint32_t thread_id() {
+    static thread_local uint32_t id = syscall(SYS_gettid);
+    return id;
+}
+
+/*
+ *  The writer sets sleeping, looks at the ring once more and only then
+ *  blocks; a producer pushes, then looks at sleeping. With a full fence on
+ *  both sides at least one of them sees the other, so no record is left
+ *  behind a sleeping writer, and only the producer that clears sleeping
+ *  makes the write() syscall.
+ */
+struct GlobalContext::Async {
+    my::MpscRing<Record> ring;
+    std::atomic<bool> running{true};
+    std::atomic<bool> sleeping{false};
+    std::atomic<uint64_t> dropped{0};
+    int wakeup{-1};
+    std::thread writer;
+
+    explicit Async(size_t capacity) : ring(capacity) {
+        wakeup = eventfd(0, EFD_CLOEXEC);
+        if (wakeup < 0) throw std::runtime_error("Cannot create log writer wakeup event");
+    }
+    ~Async() { close(wakeup); }
+
+    void wake() {
+        uint64_t one = 1;
+        if (::write(wakeup, &one, sizeof(one)) < 0) {
+            // Counter overflow only, the writer is awake then anyway
+        }
+    }
+
+    void pushed() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false)) wake();
+    }
+
+    void sleep() {
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ring.empty() || !running.load(std::memory_order_acquire)) {
+            sleeping.store(false, std::memory_order_relaxed);
+            return;
+        }
+
+        uint64_t count = 0;
+        if (read(wakeup, &count, sizeof(count)) < 0) {
+            // EINTR, the loop looks at the ring again
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+};
+
+/*
+ *  Marks a write() in flight for quiesce(). The epoch is read again after
+ *  the increment: if an updater moved on in between, it may not have seen
+ *  this writer, so the writer moves over to the new epoch's counter.
+ */
+struct InFlight {
+    std::atomic<int> *writers;
+
+    explicit InFlight(const GlobalContext &context) {
+        while (true) {
+            unsigned epoch = context.epoch.load();
+            writers = &context.writers[epoch & 1];
+            writers->fetch_add(1);
+
+            if (context.epoch.load() == epoch) break;
+            writers->fetch_sub(1);
+        }
+    }
+    ~InFlight() { writers->fetch_sub(1); }
+};
+
+GlobalContext::GlobalContext() : outputs(new Outputs) {}
+
+GlobalContext::~GlobalContext() {
+    stop_async();
+    delete outputs.load();
+}
+
 GlobalContext &GlobalContext::instance() {
     static GlobalContext instance;
     return instance;
 }
 
-void GlobalContext::write(std::stringstream &log, Level log_level, LocalContext ctx) const {
-    if (log_level < level) return;
+void GlobalContext::publish(const Outputs *new_outputs) {
+    const Outputs *old = outputs.exchange(new_outputs);
+    quiesce();
+    delete old;
+}
+
+/* Updaters are serialized by configuration, so one epoch is in flight at a time */
+void GlobalContext::quiesce() const {
+    unsigned previous = epoch.fetch_add(1) & 1;
+    while (writers[previous].load() != 0) {
+        std::this_thread::yield();
+    }
+}
+
+void GlobalContext::write(const Args &args, Level log_level, LocalContext ctx) const {
+    if (!enabled(log_level)) return;
+
+    Record record;
+    record.time = std::chrono::system_clock::now();
+    record.level = log_level;
+    record.thread = thread_id();
+    record.context = ctx;
+    record.args.size = args.size;
+    std::memcpy(record.args.data, args.data, args.size);
+
+    InFlight in_flight(*this);
+
+    if (Async *queue = async.load()) {
+        if (!queue->ring.try_push(std::move(record))) {
+            queue->dropped.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            queue->pushed();
+        }
+        return;
+    }
+
+    const Outputs &handlers = *outputs.load();
+    format(handlers, record);
+    flush(handlers);
+}
+
+/* "%F %T " of the current second, localtime() runs once a second per thread */
+static std::string_view date_time_prefix(std::time_t t) {
+    static thread_local std::time_t cached = -1;
+    static thread_local char prefix[32];
+    static thread_local size_t length = 0;
+
+    if (t != cached) {
+        std::tm tm;
+        localtime_r(&t, &tm);
+        length = std::strftime(prefix, sizeof(prefix), "%F %T ", &tm);
+        cached = t;
+    }
+
+    return std::string_view(prefix, length);
+}
+
+size_t format_line(char *out, size_t size, std::chrono::system_clock::time_point time,
+                   Level level, uint32_t thread, const char *context, std::string_view message) {
+    std::string_view prefix = date_time_prefix(std::chrono::system_clock::to_time_t(time));
+    size_t length = std::min(prefix.size(), size - 1);
+    std::memcpy(out, prefix.data(), length);
 
-    std::time_t t = std::time(nullptr);
-    std::tm tm = *std::localtime(&t);
+    length += std::snprintf(out + length, size - length, "%8s %u", log_level_to_cstr(level), thread);
+    length = std::min(length, size - 1);
+    if (context) {
+        length += std::snprintf(out + length, size - length, " [%s]", context);
+        length = std::min(length, size - 1);
+    }
+    length += std::snprintf(out + length, size - length, " %-25.*s", (int)message.size(), message.data());
 
-    // Could not push parts of the log directly, because handler is a pointer to a base class
-    // and pure virtual functions cannot be template
-    std::stringstream temporary_log;
-    temporary_log
-            << std::put_time(&tm, "%F %T ")
-            << std::setw(8) << log_level_to_cstr(log_level);
-    if (ctx.name) temporary_log << " [" << ctx.name << "]";
-    temporary_log << " " << std::left << std::setw(25) << log.str();
+    return std::min(length, size - 1);
+}
+
+void GlobalContext::format(const Outputs &handlers, const Record &record) const {
+    // Per-thread buffers, only the handler write itself is under a lock
+    static thread_local char message[max_message];
+    static thread_local char line[max_message + 128];
+
+    // Text is made only when some handler wants it
+    std::string_view text;
+    for (auto& handler : handlers) {
+        if (record.level < handler->level) continue;
+
+        if (handler->structured()) {
+            std::lock_guard<std::mutex> lock(handler->mutex);
+            handler->write_record(record);
+            continue;
+        }
+
+        if (text.empty()) {
+            size_t length = render(record.args.data, record.args.size, message, sizeof(message));
+            text = std::string_view(line, format_line(line, sizeof(line), record.time, record.level, record.thread,
+                                                      record.context.name, std::string_view(message, length)));
+        }
+
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        handler->write(text);
+    }
+}
 
-    for (auto& handler : outputs) {
-        if (log_level < handler->level) continue;
-        handler->write(temporary_log);
+void GlobalContext::flush(const Outputs &handlers) const {
+    for (auto& handler : handlers) {
+        std::lock_guard<std::mutex> lock(handler->mutex);
+        handler->flush();
     }
 }
 
+GlobalContext &GlobalContext::start_async(size_t capacity) {
+    std::lock_guard<std::mutex> lock(configuration);
+    if (async.load()) return *this;
+
+    Async *queue = new Async(capacity);
+    queue->writer = std::thread([this, queue] {
+        Record record;
+        while (true) {
+            // Check before draining, so nothing pushed before stop is lost
+            bool stopping = !queue->running.load(std::memory_order_acquire);
+
+            size_t batch = 0;
+            {
+                InFlight in_flight(*this);
+                const Outputs &handlers = *outputs.load();
+
+                while (queue->ring.try_pop(record)) {
+                    format(handlers, record);
+                    ++batch;
+                }
+                if (batch > 0) flush(handlers);
+            }
+
+            if (batch == 0) {
+                if (stopping) break;
+
+                queue->sleep();
+            }
+        }
+    });
+    async.store(queue);
+
+    return *this;
+}
+
+GlobalContext &GlobalContext::stop_async() {
+    std::unique_lock<std::mutex> lock(configuration);
+
+    // New records go straight to the handlers, then whatever is queued is drained
+    Async *queue = async.exchange(nullptr);
+    if (queue == nullptr) return *this;
+    quiesce();
+
+    queue->running.store(false, std::memory_order_release);
+    queue->wake();
+    queue->writer.join();
+
+    uint64_t lost = queue->dropped.load();
+    delete queue;
+    lock.unlock();
+
+    if (lost > 0) {
+        // Not through Log, it may run at exit
+        Args args;
+        args.literal("Log ring was full, ");
+        args.uinteger(lost);
+        args.literal(" records dropped");
+        write(args, Level::Warning, LocalContext(__FILE__));
+    }
+
+    return *this;
+}
+
+uint64_t GlobalContext::dropped() const {
+    InFlight in_flight(*this);
+    Async *queue = async.load();
+    return queue ? queue->dropped.load(std::memory_order_relaxed) : 0;
+}
+
 GlobalContext &GlobalContext::set_level(Level new_level) {
     this->level = new_level;
     return *this;
 }
 
-GlobalContext &GlobalContext::attach(std::ostream &os, Level handler_level) {
-    outputs.push_back(std::make_unique<StreamHandler>(os, handler_level));
+GlobalContext &GlobalContext::attach(std::unique_ptr<Handler> handler) {
+    std::lock_guard<std::mutex> lock(configuration);
+
+    Outputs *new_outputs = new Outputs(*outputs.load());
+    new_outputs->push_back(std::move(handler));
+    publish(new_outputs);
     return *this;
 }
 
+GlobalContext &GlobalContext::attach(std::ostream &os, Level handler_level) {
+    return attach(std::make_unique<StreamHandler>(os, handler_level));
+}
+
 GlobalContext &GlobalContext::attach(const char *filename, Level handler_level) {
-    outputs.push_back(std::make_unique<FileHandler>(filename, handler_level));
-    return *this;
+    return attach(std::make_unique<FileHandler>(filename, handler_level));
+}
+
+GlobalContext &GlobalContext::attach_binary(const char *filename, Level handler_level) {
+    return attach(std::make_unique<BinaryHandler>(filename, handler_level));
 }
 
 GlobalContext &GlobalContext::reset() {
+    stop_async();
+
+    std::lock_guard<std::mutex> lock(configuration);
     level = Level::Debug;
-    outputs.clear();
+    publish(new Outputs);
     return *this;
 }
 
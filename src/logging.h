@@ -1,30 +1,59 @@
 #ifndef TIMELAPSER_LOGGING_H
 #define TIMELAPSER_LOGGING_H
 
-#include <sstream>
+#include <cstdint>
+#include <cstring>
 #include <ostream>
+#include <streambuf>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 #define STRINGIFY2(X) #X
 #define STRINGIFY(X) STRINGIFY2(X)
 
+/*
+ *  Levels below LOG_MIN_LEVEL are removed at compile time, their arguments
+ *  are never evaluated. Levels below GlobalContext::level are skipped at
+ *  run time before the arguments are evaluated as well.
+ *
+ *  Release builds keep warnings and errors, build with
+ *  -DLOG_MIN_LEVEL=LOG_LEVEL_DEBUG to get everything back.
+ */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_DISABLED 4
+
+#ifndef LOG_MIN_LEVEL
 #ifdef _DEBUG
-#define LOG_CONTEXT(name) static Log::LocalContext log_ctx_(name)
-#define LOG_DEBUG Log::Log(Log::LocalContext(__FILE__ ":" STRINGIFY(__LINE__))).debug()
-#define LOG_INFO Log::Log(Log::LocalContext(__FILE__ ":" STRINGIFY(__LINE__))).info()
-#define LOG_WARNING Log::Log(Log::LocalContext(__FILE__ ":" STRINGIFY(__LINE__))).warning()
-#define LOG_ERROR Log::Log(Log::LocalContext(__FILE__ ":" STRINGIFY(__LINE__))).error()
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
 #else
-#define LOG_CONTEXT(name) struct SEMICOLON__
-struct DevNullSink {};
-template <typename T>
-DevNullSink const& operator<<(DevNullSink const& sink, T const&) { return sink; }
-#define LOG_DEBUG DevNullSink()
-#define LOG_INFO DevNullSink()
-#define LOG_WARNING DevNullSink()
-#define LOG_ERROR DevNullSink()
+#define LOG_MIN_LEVEL LOG_LEVEL_WARNING
 #endif
+#endif
+
+#define LOG_CONTEXT(name) static Log::LocalContext log_ctx_(name)
+
+// An expression rather than an if, so a trailing else of the caller stays with its own if.
+// The condition is a constant false for levels below LOG_MIN_LEVEL, nothing is left of them.
+#define LOG_AT(lvl, method) \
+    !(::Log::compiled_in(::Log::Level::lvl) && ::Log::GlobalContext::instance().enabled(::Log::Level::lvl)) \
+        ? (void)0 \
+        : ::Log::Voidify() & ::Log::Log(::Log::LocalContext(__FILE__ ":" STRINGIFY(__LINE__))).method()
+
+#define LOG_DEBUG LOG_AT(Debug, debug)
+#define LOG_INFO LOG_AT(Info, info)
+#define LOG_WARNING LOG_AT(Warning, warning)
+#define LOG_ERROR LOG_AT(Error, error)
+
+// Stored by address instead of copied; "" text only compiles when text is a string literal
+#define LOG_LIT(text) ::Log::Literal{"" text}
 
 namespace Log {
 
@@ -36,6 +65,12 @@ enum class Level {
     Disabled,
 };
 
+constexpr Level min_level = static_cast<Level>(LOG_MIN_LEVEL);
+
+constexpr bool compiled_in(Level level) {
+    return level >= min_level;
+}
+
 struct LocalContext {
     const char *name;
 
@@ -43,12 +78,81 @@ struct LocalContext {
     explicit LocalContext(const char *name) noexcept;
 };
 
+/* Longest message kept, the rest of it is cut off */
+constexpr size_t max_message = 256;
+
+/*
+ *  Stream buffer over a fixed array, so formatting a message never
+ *  allocates. Characters past the end are dropped.
+ */
+struct LineBuffer : std::streambuf {
+    char data[max_message];
+
+    LineBuffer() { clear(); }
+
+    void clear() { setp(data, data + max_message); }
+    std::string_view view() const { return std::string_view(pbase(), pptr() - pbase()); }
+
+protected:
+    int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+};
+
+/*
+ *  Arguments of a message as they were passed to <<, not formatted yet.
+ *  Every argument is a type byte followed by its raw value, strings carry a
+ *  16-bit length. Literals marked with LOG_LIT are stored as their address
+ *  only, they live as long as the program; every other string is copied.
+ */
+struct Args {
+    enum Type : uint8_t {
+        Literal = 1,  // uint64 address
+        String,       // uint16 length, bytes
+        Int,          // int64
+        UInt,         // uint64
+        Double,       // double
+        Char,         // char
+        Pointer,      // uint64
+    };
+
+    size_t size = 0;
+    bool full = false;
+    uint8_t data[max_message];
+
+    void literal(const char *text);
+    void string(std::string_view text);
+    void integer(int64_t value);
+    void uinteger(uint64_t value);
+    void floating(double value);
+    void character(char value);
+    void pointer(const void *value);
+
+private:
+    bool put(Type type, const void *value, size_t value_size);
+};
+
+/* A string literal, see LOG_LIT */
+struct Literal {
+    const char *text;
+};
+
+/* Text of a literal by its id, the address when it is not given */
+using LiteralResolver = std::string_view (*)(uint64_t id, const void *user);
+
+/* Renders encoded arguments the way std::ostream would print them, returns the length */
+size_t render(const uint8_t *args, size_t size, char *out, size_t out_size,
+              LiteralResolver resolve = nullptr, const void *user = nullptr);
+
+/* Formatted text of a value without a raw encoding, in a thread-local buffer */
+std::ostream &scratch_stream();
+std::string_view scratch_text();
+
 struct Log {
     LocalContext context;
     Level level = Level::Disabled;
-    std::stringstream log;
+    Args args;
 
     explicit Log(LocalContext ctx = LocalContext());
+    Log(const Log&) = delete;
     ~Log();
 
     Log &error();
@@ -57,27 +161,127 @@ struct Log {
     Log &debug();
 };
 
+/*
+ *  Numbers, characters, pointers and strings are stored raw, anything else
+ *  is formatted with its operator<< right away. Stream manipulators have no
+ *  effect on a record and are ignored.
+ */
 template <typename T>
 Log &operator<<(Log &logger, T&& data) {
-    logger.log << data;
+    using Raw = std::remove_reference_t<T>;
+    using Value = std::decay_t<T>;
+
+    if constexpr (std::is_same_v<Value, Literal>) {
+        logger.args.literal(data.text);
+    } else if constexpr (std::is_array_v<Raw> && std::is_same_v<std::remove_cv_t<std::remove_extent_t<Raw>>, char>) {
+        // Could be a local or a member just as well as a literal, only LOG_LIT is trusted to stay
+        logger.args.string(std::string_view(data, strnlen(data, std::extent_v<Raw>)));
+    } else if constexpr (std::is_same_v<Value, char*> || std::is_same_v<Value, const char*>) {
+        logger.args.string(data ? std::string_view(data) : std::string_view("(null)"));
+    } else if constexpr (std::is_convertible_v<const Value&, std::string_view>) {
+        logger.args.string(data);
+    } else if constexpr (std::is_same_v<Value, bool>) {
+        logger.args.uinteger(data);
+    } else if constexpr (std::is_same_v<Value, char> || std::is_same_v<Value, signed char> ||
+                         std::is_same_v<Value, unsigned char>) {
+        logger.args.character(data);
+    } else if constexpr (std::is_integral_v<Value> && std::is_signed_v<Value>) {
+        logger.args.integer(data);
+    } else if constexpr (std::is_integral_v<Value>) {
+        logger.args.uinteger(data);
+    } else if constexpr (std::is_floating_point_v<Value>) {
+        logger.args.floating(data);
+    } else if constexpr (std::is_function_v<Raw> || std::is_function_v<std::remove_pointer_t<Value>>) {
+        // manipulator
+    } else if constexpr (std::is_pointer_v<Value>) {
+        logger.args.pointer(data);
+    } else {
+        scratch_stream() << data;
+        logger.args.string(scratch_text());
+    }
     return logger;
 }
 
+/* Lower precedence than <<, turns the whole message into void for LOG_AT */
+struct Voidify {
+    void operator&(Log &) {}
+};
+
+/* A message on its way from the caller to the handlers, kept inline to avoid allocations */
+struct Record {
+    std::chrono::system_clock::time_point time;
+    Level level = Level::Disabled;
+    uint32_t thread = 0;
+    LocalContext context;
+    Args args;
+};
+
+/* Kernel id of the calling thread, as top and gdb show it */
+uint32_t thread_id();
+
+const char *log_level_to_cstr(Level level);
+
+/* "date time LEVEL thread [context] message", the text handlers write; returns the length */
+size_t format_line(char *out, size_t size, std::chrono::system_clock::time_point time,
+                   Level level, uint32_t thread, const char *context, std::string_view message);
+
 struct Handler;
 struct GlobalContext {
-    Level level = Level::Debug;
-    std::vector<std::unique_ptr<Handler>> outputs;
+    std::atomic<Level> level{Level::Debug};
 
     static GlobalContext &instance();
     GlobalContext &set_level(Level level);
+    GlobalContext &attach(std::unique_ptr<Handler> handler);
     GlobalContext &attach(std::ostream &os, Level level = Level::Debug);
     GlobalContext &attach(const char *filename, Level level = Level::Debug);
+    GlobalContext &attach_binary(const char *filename, Level level = Level::Debug);
     GlobalContext &reset();
 
-    void write(std::stringstream &log, Level log_level, LocalContext ctx) const;
+    bool enabled(Level log_level) const { return log_level >= level.load(std::memory_order_relaxed); }
+
+    /*
+     *  In asynchronous mode callers only push records into a lock-free
+     *  ring, a background thread formats them and flushes the handlers once
+     *  per batch. When the ring is full the record is dropped and counted,
+     *  the caller never waits. An idle writer thread sleeps on an eventfd,
+     *  the first record pushed while it sleeps wakes it.
+     */
+    GlobalContext &start_async(size_t capacity = 4096);
+    GlobalContext &stop_async();
+    uint64_t dropped() const;
+
+    void write(const Args &args, Level log_level, LocalContext ctx) const;
 
 private:
-    GlobalContext() = default;
+    /*
+     *  The handler list is never changed in place. attach() and reset()
+     *  publish a new one and wait until no write() in flight can still see
+     *  the old one, so finding the handlers takes no lock. Writers count
+     *  themselves in one of two counters chosen by epoch, and the updater
+     *  only waits for the previous epoch, so a steady stream of writers
+     *  cannot hold it forever. Only the async producer path is lock-free:
+     *  synchronous writes, and the async writer thread, take each
+     *  handler's own lock while a line is written to it.
+     */
+    using Outputs = std::vector<std::shared_ptr<Handler>>;
+    struct Async;
+
+    std::atomic<const Outputs*> outputs;
+    std::atomic<Async*> async{nullptr};
+    mutable std::atomic<int> writers[2] = {};
+    mutable std::atomic<unsigned> epoch{0};
+    std::mutex configuration;
+
+    GlobalContext();
+    ~GlobalContext();
+
+    void publish(const Outputs *new_outputs);
+    void quiesce() const;
+
+    friend struct InFlight;
+
+    void format(const Outputs &handlers, const Record &record) const;
+    void flush(const Outputs &handlers) const;
 };
 
 }
@@ -0,0 +1,143 @@
+#include <metrics.h>
+#include <logging.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+
+
+namespace my {
+namespace metrics {
+
+constexpr uint64_t Histogram::sub_buckets;
+constexpr size_t Histogram::n_buckets;
+
+
+size_t Histogram::bucket_of(uint64_t ns) {
+    if (ns < sub_buckets) return ns;
+
+    int magnitude = 63 - __builtin_clzll(ns);
+    int shift = magnitude - sub_bits;
+    uint64_t sub = (ns >> shift) & (sub_buckets - 1);
+
+    return (shift + 1) * sub_buckets + sub;
+}
+
+uint64_t Histogram::upper_bound(size_t bucket) {
+    if (bucket < sub_buckets) return bucket;
+
+    int shift = bucket / sub_buckets - 1;
+    uint64_t sub = bucket % sub_buckets;
+    uint64_t lower = (sub_buckets + sub) << shift;
+
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+
+Registry &Registry::instance() {
+    static Registry instance;
+    return instance;
+}
+
+template <typename T>
+T &Registry::find_or_add(std::deque<Entry<T>> &entries, const std::string &name, const std::string &help) {
+    for (auto &entry : entries) {
+        if (entry.name == name) return entry.metric;
+    }
+    entries.emplace_back(name, help);
+    return entries.back().metric;
+}
+
+Counter &Registry::counter(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return find_or_add(counters, name, help);
+}
+
+Gauge &Registry::gauge(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return find_or_add(gauges, name, help);
+}
+
+Histogram &Registry::histogram(const std::string &name, const std::string &help) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return find_or_add(histograms, name, help);
+}
+
+
+void Registry::write(std::ostream &os) const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto &entry : counters) {
+        os << "# HELP " << entry.name << " " << entry.help << "\n"
+           << "# TYPE " << entry.name << " counter\n"
+           << entry.name << " " << entry.metric.get() << "\n";
+    }
+
+    for (auto &entry : gauges) {
+        os << "# HELP " << entry.name << " " << entry.help << "\n"
+           << "# TYPE " << entry.name << " gauge\n"
+           << entry.name << " " << entry.metric.get() << "\n";
+    }
+
+    os << std::setprecision(9);
+    for (auto &entry : histograms) {
+        os << "# HELP " << entry.name << " " << entry.help << "\n"
+           << "# TYPE " << entry.name << " histogram\n";
+
+        // Every bucket up to the highest one used, counts never drop, so once a bound
+        // is written it is in every later dump and the series stay cumulative
+        size_t used = 0;
+        for (size_t i = 0; i < Histogram::n_buckets; ++i) {
+            if (entry.metric.buckets[i].load(std::memory_order_relaxed)) used = i + 1;
+        }
+
+        uint64_t count = 0;
+        for (size_t i = 0; i < used; ++i) {
+            count += entry.metric.buckets[i].load(std::memory_order_relaxed);
+            os << entry.name << "_bucket{le=\"" << Histogram::upper_bound(i) * 1e-9 << "\"} " << count << "\n";
+        }
+
+        os << entry.name << "_bucket{le=\"+Inf\"} " << count << "\n"
+           << entry.name << "_sum " << entry.metric.sum.load(std::memory_order_relaxed) * 1e-9 << "\n"
+           << entry.name << "_count " << count << "\n";
+    }
+}
+
+
+Dumper::Dumper(const std::string &filename, std::chrono::milliseconds interval)
+    : filename(filename)
+    , interval(interval)
+{
+    thread = std::thread([this] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wakeup.wait_for(lock, this->interval, [this] { return stopping; })) {
+            dump();
+        }
+    });
+}
+
+Dumper::~Dumper() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_one();
+    thread.join();
+
+    dump();
+}
+
+void Dumper::dump() const {
+    std::string temporary = filename + ".tmp";
+
+    std::ofstream out(temporary);
+    registry().write(out);
+    out.close();
+
+    if (!out || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        LOG_WARNING << "Cannot write metrics to " << filename;
+    }
+}
+
+}
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+
+namespace my {
+namespace metrics {
+
+/*
+ *  Hot paths only touch relaxed atomics, registration and dumping take the
+ *  registry lock. Metrics live as long as the process, so references
+ *  returned by Registry may be cached in statics.
+ */
+
+struct Counter {
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+struct Gauge {
+    std::atomic<int64_t> value{0};
+
+    void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/*
+ *  Latency histogram in nanoseconds with HdrHistogram-like buckets: every
+ *  power of two is split into sub_buckets linear steps, so the relative
+ *  error stays within 1/sub_buckets from nanoseconds up to hours.
+ */
+struct Histogram {
+    static constexpr int sub_bits = 3;
+    static constexpr uint64_t sub_buckets = 1 << sub_bits;
+    static constexpr size_t n_buckets = (64 - sub_bits + 1) * sub_buckets;
+
+    std::array<std::atomic<uint64_t>, n_buckets> buckets{};
+    std::atomic<uint64_t> sum{0};
+
+    void record(uint64_t ns) {
+        buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    static size_t bucket_of(uint64_t ns);
+    static uint64_t upper_bound(size_t bucket);  // inclusive
+};
+
+/* Records the time from construction to destruction */
+struct ScopedTimer {
+    Histogram &histogram;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    explicit ScopedTimer(Histogram &histogram) : histogram(histogram) {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ~ScopedTimer() {
+        histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+struct Registry {
+    static Registry &instance();
+
+    /* Returns the existing metric when the name is already registered */
+    Counter &counter(const std::string &name, const std::string &help);
+    Gauge &gauge(const std::string &name, const std::string &help);
+    Histogram &histogram(const std::string &name, const std::string &help);
+
+    /* Prometheus text exposition format, histograms in seconds */
+    void write(std::ostream &os) const;
+
+private:
+    template <typename T>
+    struct Entry {
+        std::string name;
+        std::string help;
+        T metric;
+
+        Entry(const std::string &name, const std::string &help) : name(name), help(help) {}
+    };
+
+    template <typename T>
+    static T &find_or_add(std::deque<Entry<T>> &entries, const std::string &name, const std::string &help);
+
+    mutable std::mutex mutex;
+    std::deque<Entry<Counter>> counters;
+    std::deque<Entry<Gauge>> gauges;
+    std::deque<Entry<Histogram>> histograms;
+
+    Registry() = default;
+};
+
+inline Registry &registry() { return Registry::instance(); }
+
+/*
+ *  Rewrites filename with the registry contents every interval from a
+ *  background thread, and once more on destruction. The file is replaced
+ *  by rename, so a scraper never reads it half written.
+ */
+struct Dumper {
+    Dumper(const std::string &filename, std::chrono::milliseconds interval);
+    Dumper(const Dumper&) = delete;
+    ~Dumper();
+
+    void dump() const;
+
+private:
+    const std::string filename;
+    const std::chrono::milliseconds interval;
+
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread thread;
+};
+
+}
+}
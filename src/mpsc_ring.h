@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+namespace my {
+
+/*
+ *  Bounded lock-free queue for many producers and one consumer, after
+ *  Dmitry Vyukov's bounded MPMC queue. Every cell carries a sequence number
+ *  telling whose turn it is, producers only contend on the head index.
+ *
+ *  try_push() never blocks: it fails when the ring is full and the caller
+ *  decides what to drop. try_pop() may be called from one thread only.
+ */
+template <typename T>
+struct MpscRing {
+    explicit MpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+
+        mask = size - 1;
+        cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    MpscRing(const MpscRing &) = delete;
+
+    bool try_push(T &&item) {
+        Cell *cell;
+        size_t position = head.load(std::memory_order_relaxed);
+
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+
+            if (diff == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;  // the consumer has not freed this cell yet
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->item = std::move(item);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &item) {
+        Cell &cell = cells[tail & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if ((intptr_t)sequence - (intptr_t)(tail + 1) < 0) return false;
+
+        item = std::move(cell.item);
+        cell.sequence.store(tail + mask + 1, std::memory_order_release);
+        ++tail;
+        return true;
+    }
+
+    // Consumer only, false while a push that already claimed its cell is still writing it
+    bool empty() const {
+        size_t sequence = cells[tail & mask].sequence.load(std::memory_order_acquire);
+        return (intptr_t)sequence - (intptr_t)(tail + 1) < 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+
+    // Producers and the consumer write to different cache lines
+    std::atomic<size_t> head{0};
+    char padding[64];
+    size_t tail = 0;
+};
+
+}
@@ -0,0 +1,119 @@
+#include <pipeline.h>
+#include <logging.h>
+#include <metrics.h>
+
+#include <linux/videodev2.h>
+
+#include <exception>
+#include <memory>
+#include <thread>
+
+
+namespace my {
+
+Pipeline::Pipeline(FrameSource &source, VideoEncoder &encoder, size_t depth)
+    : source(source)
+    , encoder(encoder)
+    , queue(depth)
+{}
+
+void Pipeline::run(size_t n_frames) {
+    std::exception_ptr capture_error;
+
+    static metrics::Gauge &queue_depth = metrics::registry().gauge(
+        "timelapser_pipeline_queue_depth", "Frames captured and waiting for the encoder");
+
+    // Compressed frames go through the decoder pool instead of the queue, it keeps them in order
+    std::unique_ptr<JpegDecoder> decoder;
+    if (!archive && source.format.pixel_format == V4L2_PIX_FMT_MJPEG) {
+        decoder.reset(new JpegDecoder(decode_threads));
+    }
+
+    auto close = [this, &decoder] {
+        queue.close();
+        if (decoder) decoder->close();
+        // The capture thread may sleep until the next shot, an hour away
+        if (scheduler) scheduler->cancel();
+    };
+
+    // pts follow capture timestamps, computed by whichever thread sees the frames in order
+    PtsClock clock(encoder.params);
+
+    std::thread capture([this, n_frames, &capture_error, &decoder, &close, &clock] {
+        try {
+            uint32_t last_sequence = 0;
+            for (size_t i = 0; i < n_frames; ++i) {
+                auto lease = scheduler ? scheduler->next_shot() : source.borrow_frame();
+                if (!lease) break;  // scheduler cancelled
+
+                // The scheduler throws stale frames away on purpose, otherwise a gap is a driver drop
+                if (!scheduler && i > 0 && lease.sequence > last_sequence + 1) {
+                    LOG_WARNING << "Source dropped " << (lease.sequence - last_sequence - 1)
+                                << " frames before frame " << i;
+                }
+                last_sequence = lease.sequence;
+
+                if (archive) {
+                    archive->push_back(source.take(std::move(lease)));
+                } else if (decoder) {
+                    int64_t pts = clock.next(lease.timestamp_ns);
+                    if (!decoder->push(std::move(lease), pts)) break;
+                } else {
+                    if (!queue.push(std::move(lease))) break;
+                    queue_depth.set(queue.size());
+                }
+
+                if ((i + 1) % 10 == 0) {
+                    LOG_DEBUG << "Captured " << (i + 1) << " of " << n_frames << " frames";
+                }
+            }
+        } catch (...) {
+            capture_error = std::current_exception();
+        }
+        close();
+    });
+
+    LOG_DEBUG << "Pipeline started, queue depth "
+              << (decoder ? decoder->capacity() : queue.capacity());
+
+    try {
+        size_t encoded = 0;
+        if (decoder) {
+            DecodedFrame decoded;
+            while (decoder->pop(decoded)) {
+                // A corrupt JPEG leaves a gap rather than stopping the shoot
+                if (decoded.frame) encoder.push_frame(decoded.frame, decoded.pts);
+                ++encoded;
+
+                if (encoded % 10 == 0) {
+                    LOG_DEBUG << "Encoded " << encoded << " frames";
+                }
+            }
+        } else {
+            FrameLease lease;
+            while (queue.pop(lease)) {
+                queue_depth.set(queue.size());
+                encoder.push_frame(lease.data, lease.size, clock.next(lease.timestamp_ns));
+                ++encoded;
+                // Frame data is already converted into the encoder, give the buffer back
+                lease.release();
+
+                if (encoded % 10 == 0) {
+                    LOG_DEBUG << "Encoded " << encoded << " frames, " << queue.size() << " waiting in queue";
+                }
+            }
+        }
+    } catch (...) {
+        // Unblock the capture thread before leaving
+        close();
+        capture.join();
+        throw;
+    }
+
+    capture.join();
+    if (capture_error) std::rethrow_exception(capture_error);
+
+    LOG_DEBUG << "Pipeline finished";
+}
+
+}
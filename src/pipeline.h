@@ -0,0 +1,47 @@
+#pragma once
+
+#include <frame.h>
+#include <frame_queue.h>
+#include <frame_source.h>
+#include <jpeg_decoder.h>
+#include <video_encoder.h>
+#include <interval_scheduler.h>
+
+#include <vector>
+
+
+namespace my {
+
+/*
+ *  Capture thread feeds the encoder through a fixed-depth queue, so frames
+ *  are encoded and muxed as they arrive and memory stays constant no matter
+ *  how long the shoot is.
+ *
+ *  Queued frames are leases on driver buffers, so the queue should stay
+ *  shallower than the number of buffers given to init_buffers().
+ *
+ *  MJPEG sources are decoded by a JpegDecoder pool between capture and
+ *  encode; it holds up to decode_threads + 2 leases instead of the queue.
+ *
+ *  With an archive set, frames are taken from the source (FrameSource::take)
+ *  and kept there instead of being encoded, MJPEG stays compressed until
+ *  VideoEncoder::render or SegmentRenderer decodes it.
+ *
+ *  The encoder has to be open already, finishing it is up to the caller.
+ *  With a scheduler set, frames are taken one per interval for a timelapse,
+ *  otherwise at the source's native rate.
+ */
+struct Pipeline {
+    FrameSource &source;
+    VideoEncoder &encoder;
+    FrameQueue<FrameLease> queue;
+    IntervalScheduler *scheduler{nullptr};
+    size_t decode_threads{0};  // MJPEG decoder workers, 0 picks from the core count
+    std::vector<Frame> *archive{nullptr};  // frames to render later, the encoder is left alone
+
+    Pipeline(FrameSource &source, VideoEncoder &encoder, size_t depth = 2);
+
+    void run(size_t n_frames);
+};
+
+}
@@ -0,0 +1,142 @@
+#include <reactor.h>
+#include <logging.h>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <cerrno>
+#include <stdexcept>
+
+
+namespace my {
+
+Reactor::Reactor() {
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0) {
+        throw std::runtime_error("Cannot create epoll instance");
+    }
+
+    wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup < 0) {
+        close(epoll);
+        throw std::runtime_error("Cannot create reactor wakeup event");
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = wakeup;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &event) < 0) {
+        close(wakeup);
+        close(epoll);
+        throw std::runtime_error("Cannot watch reactor wakeup event");
+    }
+}
+
+Reactor::~Reactor() {
+    for (int timer : timers) close(timer);
+    close(wakeup);
+    close(epoll);
+}
+
+void Reactor::add(int fd, uint32_t events, Callback callback) {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        throw std::runtime_error("Cannot watch descriptor " + std::to_string(fd));
+    }
+
+    watches[fd] = std::make_shared<Callback>(std::move(callback));
+}
+
+void Reactor::remove(int fd) {
+    if (watches.erase(fd) == 0) return;
+
+    epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+    if (timers.erase(fd)) close(fd);
+}
+
+int Reactor::add_timer(std::chrono::nanoseconds interval, TimerCallback callback, bool periodic) {
+    if (interval.count() <= 0) {
+        throw std::runtime_error("Timer interval must be positive");
+    }
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer < 0) {
+        throw std::runtime_error("Cannot create timer");
+    }
+
+    itimerspec spec{};
+    spec.it_value.tv_sec = interval.count() / 1000000000LL;
+    spec.it_value.tv_nsec = interval.count() % 1000000000LL;
+    if (periodic) spec.it_interval = spec.it_value;
+
+    if (timerfd_settime(timer, 0, &spec, nullptr) < 0) {
+        close(timer);
+        throw std::runtime_error("Cannot arm timer");
+    }
+
+    timers.insert(timer);
+    add(timer, EPOLLIN, [this, timer, periodic, callback] (uint32_t) {
+        uint64_t expirations = 0;
+        if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+        if (!periodic) remove(timer);
+        callback(expirations);
+    });
+
+    return timer;
+}
+
+size_t Reactor::run_once(int timeout_ms) {
+    epoll_event events[16];
+
+    int n = epoll_wait(epoll, events, 16, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        throw std::runtime_error("epoll_wait failed");
+    }
+
+    size_t handled = 0;
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+
+        if (fd == wakeup) {
+            uint64_t value;
+            if (read(wakeup, &value, sizeof(value)) < 0) {}
+            continue;
+        }
+
+        // An earlier callback of this batch may have removed it
+        auto it = watches.find(fd);
+        if (it == watches.end()) continue;
+
+        // Keeps the callback alive if it removes its own watch
+        std::shared_ptr<Callback> callback = it->second;
+        (*callback)(events[i].events);
+        ++handled;
+    }
+
+    return handled;
+}
+
+void Reactor::run() {
+    while (!stopping) {
+        run_once();
+    }
+    stopping = false;
+}
+
+void Reactor::stop() {
+    stopping = true;
+
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0) {
+        LOG_WARNING << "Cannot wake up reactor";
+    }
+}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+
+
+namespace my {
+
+/*
+ *  Single-threaded event loop over epoll. Device descriptors and timers
+ *  are registered with a callback that runs on the thread calling run(),
+ *  so one thread can serve several cameras and deadlines without blocking
+ *  on any of them. Callbacks may add and remove watches, including their
+ *  own. stop() is the only method safe to call from another thread.
+ */
+struct Reactor {
+    using Callback = std::function<void(uint32_t events)>;
+    using TimerCallback = std::function<void(uint64_t expirations)>;
+
+    Reactor();
+    Reactor(const Reactor &) = delete;
+    ~Reactor();
+
+    void add(int fd, uint32_t events, Callback callback);
+    void remove(int fd);
+
+    // Returns the timer descriptor, pass it to remove()
+    int add_timer(std::chrono::nanoseconds interval, TimerCallback callback, bool periodic = true);
+
+    // Waits up to timeout (-1 for ever) and dispatches, returns the number of events handled
+    size_t run_once(int timeout_ms = -1);
+    void run();
+    void stop();
+
+private:
+    int epoll{-1};
+    int wakeup{-1};
+    std::atomic<bool> stopping{false};
+
+    std::map<int, std::shared_ptr<Callback>> watches;
+    std::set<int> timers;  // descriptors the reactor created and closes
+};
+
+}
@@ -0,0 +1,126 @@
+#include <segment_renderer.h>
+#include <logging.h>
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+
+namespace my {
+
+struct Segment {
+    size_t begin{0};
+    size_t end{0};
+    std::unique_ptr<VideoEncoder> encoder;  // kept after finish() for its codec parameters
+    std::vector<AVPacket*> packets;
+    std::exception_ptr error;
+};
+
+
+SegmentRenderer::SegmentRenderer(size_t n_segments_)
+    : n_segments(n_segments_)
+{
+    if (n_segments == 0) n_segments = std::max(1u, std::thread::hardware_concurrency());
+}
+
+
+static void encode_segment(const std::vector<Frame> &frames, const std::vector<int64_t> &pts,
+                           const EncoderParams &params, Segment &segment) {
+    try {
+        segment.encoder->open(params);
+
+        for (size_t i = segment.begin; i < segment.end; ++i) {
+            segment.encoder->push_frame(frames[i], pts[i]);
+        }
+
+        segment.encoder->finish();
+        segment.packets = segment.encoder->take_packets();
+    } catch (...) {
+        segment.error = std::current_exception();
+    }
+}
+
+
+void SegmentRenderer::render(const std::vector<Frame> &frames, const char *filename, const EncoderParams &params) {
+    // The stream takes its parameters from a segment encoder, without frames there is none
+    if (frames.empty()) {
+        throw std::runtime_error(std::string("No frames to render into ") + filename);
+    }
+
+    // Every segment starts with a fresh encoder, hence an IDR frame,
+    // so cutting on GOP boundaries keeps the keyframe cadence intact.
+    size_t gop = std::max(1, params.gop_size);
+    size_t n_gops = (frames.size() + gop - 1) / gop;
+    size_t gops_per_segment = std::max<size_t>(1, (n_gops + n_segments - 1) / n_segments);
+
+    std::vector<Segment> segments;
+    for (size_t begin = 0; begin < frames.size(); begin += gops_per_segment * gop) {
+        Segment segment;
+        segment.begin = begin;
+        segment.end = std::min(frames.size(), begin + gops_per_segment * gop);
+        segment.encoder.reset(new VideoEncoder);
+        segments.push_back(std::move(segment));
+    }
+
+    // Parallelism comes from segments, one codec thread each unless told otherwise
+    EncoderParams segment_params = params;
+    if (segment_params.thread_count == 0) segment_params.thread_count = 1;
+    segment_params.latency = EncoderParams::Latency::Offline;
+
+    // One clock over the whole archive, so timestamps run on across segment boundaries
+    PtsClock clock(segment_params);
+    std::vector<int64_t> pts;
+    pts.reserve(frames.size());
+    for (const Frame &frame : frames) pts.push_back(clock.next(frame.timestamp_ns));
+
+    LOG_DEBUG << "Rendering " << frames.size() << " frames in " << segments.size() << " segments";
+
+    std::vector<std::thread> workers;
+    for (Segment &segment : segments) {
+        workers.emplace_back(encode_segment, std::cref(frames), std::cref(pts),
+                             std::cref(segment_params), std::ref(segment));
+    }
+
+    // Segments are muxed in order as each one finishes, later ones keep encoding meanwhile
+    VideoEncoder muxer;
+    std::exception_ptr error;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        Segment &segment = segments[i];
+        workers[i].join();
+
+        if (segment.error && !error) error = segment.error;
+
+        if (!error) {
+            try {
+                // Every segment encoder has the same parameters, the first one describes the stream
+                if (i == 0) muxer.open(filename, *segment.encoder);
+
+                for (AVPacket *packet : segment.packets) {
+                    muxer.write_packet(packet);
+                }
+                LOG_DEBUG << "Segment of frames [" << segment.begin << ", " << segment.end << ") muxed";
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+
+        for (AVPacket *packet : segment.packets) av_packet_free(&packet);
+        segment.packets.clear();
+        segment.encoder.reset();
+    }
+
+    if (!error) {
+        try {
+            muxer.finish();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    if (error) std::rethrow_exception(error);
+}
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <frame.h>
+#include <video_encoder.h>
+
+
+namespace my {
+
+/*
+ *  Renders a captured archive on several cores at once.
+ *
+ *  Frames are split at GOP boundaries into n_segments pieces, every piece
+ *  is encoded on its own codec context and thread. Each segment is muxed
+ *  as soon as it and all segments before it are done; the output stream
+ *  takes its parameters from the first segment's codec. pts come from the
+ *  frames' capture timestamps through one PtsClock for the whole archive,
+ *  so timestamps in the output stay continuous. An empty archive throws.
+ */
+struct SegmentRenderer {
+    size_t n_segments;
+
+    explicit SegmentRenderer(size_t n_segments = 0);  // 0 means one per core
+
+    void render(const std::vector<Frame> &frames, const char *filename, const EncoderParams &params);
+};
+
+}
@@ -0,0 +1,88 @@
+#include <synthetic_source.h>
+#include <logging.h>
+
+#include <linux/videodev2.h>
+
+#include <stdexcept>
+#include <thread>
+
+
+namespace my {
+
+/*
+ *  YUYV version of muxing.c fill_yuv_image(), chroma is sampled per row.
+ */
+static void fill_yuyv_image(uint8_t *data, int frame_index, int width, int height) {
+    int i = frame_index;
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; x += 2) {
+            *data++ = x + y + i * 3;
+            *data++ = 128 + y + i * 2;
+            *data++ = x + 1 + y + i * 3;
+            *data++ = 64 + x / 2 + i * 5;
+        }
+    }
+}
+
+
+SyntheticSource::SyntheticSource(uint32_t width, uint32_t height, uint32_t fps, size_t n_patterns) {
+    if (width == 0 || height == 0 || width % 2 || fps == 0 || n_patterns == 0) {
+        throw std::runtime_error("Invalid synthetic source parameters");
+    }
+
+    format.width = width;
+    format.height = height;
+    format.pixel_format = V4L2_PIX_FMT_YUYV;
+    format.bytes_per_line = width * 2;
+    format.image_size = width * height * 2;
+    format.interval_numerator = 1;
+    format.interval_denominator = fps;
+
+    interval = std::chrono::nanoseconds(1000000000LL / fps);
+
+    patterns.resize(n_patterns);
+    for (size_t i = 0; i < n_patterns; ++i) {
+        patterns[i].resize(format.image_size);
+        fill_yuyv_image(patterns[i].data(), i, width, height);
+    }
+
+    frame_pool.set_buffer_size(format.image_size);
+
+    LOG_DEBUG << "Synthetic source " << width << "x" << height << " @ " << fps << " fps";
+}
+
+void SyntheticSource::start() {
+    next_due = std::chrono::steady_clock::now();
+    state = State::StreamON;
+}
+
+void SyntheticSource::stop() {
+    state = State::StreamOFF;
+}
+
+FrameLease SyntheticSource::borrow_frame() {
+    if (state != State::StreamON) {
+        throw std::runtime_error("Synthetic source is not started");
+    }
+
+    if (paced) {
+        std::this_thread::sleep_until(next_due);
+
+        // A consumer that fell behind loses frames, like with a real camera
+        auto now = std::chrono::steady_clock::now();
+        next_due = now > next_due + interval ? now : next_due + interval;
+    }
+
+    uint32_t index = next++ % patterns.size();
+    // Patterns are never written to, any number of leases can share one
+    return FrameLease(this, index, patterns[index].data(), patterns[index].size());
+}
+
+bool SyntheticSource::frame_ready() {
+    return state == State::StreamON && (!paced || std::chrono::steady_clock::now() >= next_due);
+}
+
+void SyntheticSource::requeue(uint32_t) {}
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <frame_source.h>
+
+
+namespace my {
+
+/*
+ *  Camera stand-in that delivers a moving YUYV test pattern, the same one
+ *  muxing.c fill_yuv_image() draws. Patterns are rendered once up front,
+ *  so the source itself costs nothing and every run sees identical frames.
+ *
+ *  Paced, frames come at the format's frame rate like from a real camera,
+ *  otherwise as fast as they are asked for.
+ */
+struct SyntheticSource : FrameSource {
+    bool paced{true};
+
+    SyntheticSource(uint32_t width, uint32_t height, uint32_t fps = 30, size_t n_patterns = 30);
+
+    void start() override;
+    void stop() override;
+
+    FrameLease borrow_frame() override;
+    bool frame_ready() override;
+    void requeue(uint32_t index) override;
+
+private:
+    std::vector<std::vector<uint8_t>> patterns;
+    size_t next{0};
+
+    std::chrono::nanoseconds interval;
+    std::chrono::steady_clock::time_point next_due;
+};
+
+}
@@ -4,12 +4,19 @@ extern "C" {
 #include <libavutil/opt.h>
 }
 
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <string>
 #include <fstream>
 #include <stdexcept>
 
+#include <jpeg_decoder.h>
 #include <logging.h>
+#include <metrics.h>
+#include <yuyv.h>
 
 
 namespace my {
@@ -17,89 +24,208 @@ namespace my {
 static const AVPixelFormat pixel_format = AV_PIX_FMT_YUYV422;
 
 
+struct EncoderMetrics {
+    metrics::Histogram &convert = metrics::registry().histogram(
+        "timelapser_encoder_convert_seconds", "YUYV to planar conversion per frame");
+    metrics::Histogram &encode = metrics::registry().histogram(
+        "timelapser_encoder_encode_seconds", "avcodec_send_frame and avcodec_receive_packet per frame");
+    metrics::Histogram &write = metrics::registry().histogram(
+        "timelapser_encoder_write_seconds", "av_interleaved_write_frame per packet");
+    metrics::Counter &frames = metrics::registry().counter(
+        "timelapser_encoder_frames_total", "Frames sent to the codec");
+    metrics::Counter &skipped = metrics::registry().counter(
+        "timelapser_encoder_skipped_frames_total", "Frames too small to convert");
+    metrics::Counter &bytes = metrics::registry().counter(
+        "timelapser_encoder_bytes_written_total", "Packet bytes muxed into output files");
+};
+
+static EncoderMetrics &encoder_metrics() {
+    static EncoderMetrics instance;
+    return instance;
+}
+
+
 VideoEncoder::VideoEncoder() {}
 
 VideoEncoder::~VideoEncoder() {
+    if (format_context) {
+        LOG_ERROR << "File " << filename << " was not finished";
+    }
+    close();
+    for (AVPacket *kept : packets) av_packet_free(&kept);
     if (codec_context) { avcodec_free_context(&codec_context); }
+
+    delete jpeg_decoder;
+    av_frame_free(&jpeg_picture);
+}
+
+
+EncoderParams EncoderParams::from_source(const FrameSource &source) {
+    return from_source(source, EncoderParams());
+}
+
+EncoderParams EncoderParams::from_source(const FrameSource &source, EncoderParams params) {
+    // MJPEG reaches the encoder decoded, see JpegDecoder
+    if (source.format.pixel_format != V4L2_PIX_FMT_YUYV && source.format.pixel_format != V4L2_PIX_FMT_MJPEG) {
+        throw std::runtime_error("Encoder accepts only YUYV or MJPEG frames from the source");
+    }
+
+    params.width = source.format.width;
+    params.height = source.format.height;
+    params.input_linesize = source.format.bytes_per_line;
+    params.time_base = AVRational{(int)source.format.interval_numerator, (int)source.format.interval_denominator};
+
+    return params;
+}
+
+
+AVRational EncoderParams::codec_time_base() const {
+    return variable_frame_rate ? AVRational{1, 90000} : time_base;
+}
+
+
+PtsClock::PtsClock(const EncoderParams &params) {
+    AVRational codec_time_base = params.codec_time_base();
+    frame_duration = std::max<int64_t>(1, av_rescale_q(1, params.time_base, codec_time_base));
+    capture_interval_ns = params.capture_interval_ns > 0
+        ? params.capture_interval_ns
+        : av_rescale_q(1, params.time_base, AVRational{1, 1000000000});
+}
+
+int64_t PtsClock::next(int64_t timestamp_ns) {
+    int64_t pts = last < 0 ? 0 : last + frame_duration;
+
+    if (timestamp_ns > 0) {
+        if (origin_ns == 0) {
+            origin_ns = timestamp_ns;
+            origin_pts = pts;
+        }
+        pts = origin_pts + av_rescale(timestamp_ns - origin_ns, frame_duration, capture_interval_ns);
+    }
+
+    // Two frames in one tick, or a clock going back, must not break the stream
+    if (pts <= last) pts = last + 1;
+
+    last = pts;
+    return pts;
 }
 
 
-void VideoEncoder::find_codec(const char *name) {
-    codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+static const char *threading_cstr(EncoderParams::Threading threading) {
+    switch (threading) {
+        case EncoderParams::Threading::Frame: return "frame";
+        case EncoderParams::Threading::Slice: return "slice";
+        default: return "auto";
+    }
+}
+
+
+static void set_private_option(AVCodecContext *codec_context, const char *name, const std::string &value) {
+    if (value.empty()) return;
+
+    if (av_opt_set(codec_context->priv_data, name, value.c_str(), 0) < 0) {
+        LOG_WARNING << "Codec " << codec_context->codec->name << " ignored option " << name << "=" << value;
+    }
+}
+
+
+void VideoEncoder::find_codec(const EncoderParams &params) {
+    codec = avcodec_find_encoder_by_name(params.codec.c_str());
 
     if (codec == nullptr) {
-        throw std::runtime_error("Could not find codec by name " + std::string(name));
+        throw std::runtime_error("Could not find codec by name " + params.codec);
     }
 
-    LOG_DEBUG << "Codec H264 found";
+    LOG_DEBUG << "Codec " << codec->name << " found";
+
+    if (codec_context) { avcodec_free_context(&codec_context); }
 
     codec_context = avcodec_alloc_context3(codec);
     if (codec_context == nullptr) {
-        throw std::runtime_error("Could not allocate codec context for codec " + std::string(name));
+        throw std::runtime_error("Could not allocate codec context for codec " + params.codec);
     }
 
     /* set codec parameters */
-    codec_context->bit_rate = 400000;
-    codec_context->width = 640;
-    codec_context->height = 480;
-    codec_context->time_base = (AVRational){1, 30};
-    codec_context->framerate = (AVRational){30, 1};
+    codec_context->width = params.width;
+    codec_context->height = params.height;
+    // With variable frame rate time_base only tells rate control the nominal rate
+    codec_context->time_base = params.codec_time_base();
+    codec_context->framerate = av_inv_q(params.time_base);
 
-    /* emit one intra frame every ten frames
+    /* emit one intra frame every gop_size frames
      * check frame pict_type before passing frame
      * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
      * then gop_size is ignored and the output of encoder
      * will always be I frame irrespective to gop_size
      */
-    codec_context->gop_size = 10;     // magic
-    codec_context->max_b_frames = 1;  // magic
+    codec_context->gop_size = params.gop_size;
+    codec_context->max_b_frames = params.max_b_frames;
     // codec_context->pix_fmt = AV_PIX_FMT_YUYV422;  // Not supported?
-    codec_context->pix_fmt = AV_PIX_FMT_YUV422P;
-    // codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_context->pix_fmt = params.pixel_format;
 
-    if (codec->id == AV_CODEC_ID_H264) {
-        av_opt_set(codec_context->priv_data, "preset", "slow", 0); // magic
+    auto threading = params.threading;
+    if (threading == EncoderParams::Threading::Auto) {
+        threading = params.latency == EncoderParams::Latency::Live
+            ? EncoderParams::Threading::Slice
+            : EncoderParams::Threading::Frame;
     }
 
-    if (avcodec_open2(codec_context, codec, NULL) < 0) {
-        throw std::runtime_error("Could not open codec");
-    }
-
-    LOG_DEBUG << "Codec context allocated";
-}
+    // libx264 maps these onto i_threads and b_sliced_threads
+    codec_context->thread_count = params.thread_count;
+    codec_context->thread_type = threading == EncoderParams::Threading::Slice ? FF_THREAD_SLICE : FF_THREAD_FRAME;
 
+    std::string tune = params.tune;
+    if (params.latency == EncoderParams::Latency::Live) {
+        // B-frames hold output back until the next reference frame arrives
+        codec_context->max_b_frames = 0;
+        codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        if (tune.empty()) tune = "zerolatency";
+    }
 
-void VideoEncoder::render(const std::vector<Frame> &frames) {
-    const char *filename = "data/output.mp4";
-    /* Prepare output file */
-    AVFormatContext *output_format_context{nullptr};
-    if (avformat_alloc_output_context2(&output_format_context, nullptr, "mp4", nullptr) < 0) {
-        throw std::runtime_error("Could not allocate output format context");
+    if (params.lookahead_threads > 0) {
+        set_private_option(codec_context, "x264-params", "lookahead-threads=" + std::to_string(params.lookahead_threads));
     }
 
-    AVStream *out_video_stream = avformat_new_stream(output_format_context, nullptr);
-    if (out_video_stream == nullptr) {
-        throw std::runtime_error("Could not create video stream in output format");
+    if (params.rate_control == EncoderParams::RateControl::CRF) {
+        if (av_opt_set_int(codec_context->priv_data, "crf", params.crf, 0) < 0) {
+            LOG_WARNING << "Codec " << codec->name << " has no CRF mode, using bit rate " << params.bit_rate;
+            codec_context->bit_rate = params.bit_rate;
+        }
+    } else {
+        codec_context->bit_rate = params.bit_rate;
     }
 
-    if (avcodec_parameters_from_context(out_video_stream->codecpar, codec_context) < 0) {
-        throw std::runtime_error("Could not associate codec parameters with format");
+    set_private_option(codec_context, "preset", params.preset);
+    set_private_option(codec_context, "tune", tune);
+
+    if (avcodec_open2(codec_context, codec, NULL) < 0) {
+        throw std::runtime_error("Could not open codec " + params.codec);
     }
-    out_video_stream->time_base = codec_context->time_base;
 
-    /* Create output file */
-    if (!(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&output_format_context->pb, filename, AVIO_FLAG_WRITE) < 0) {
-            throw std::runtime_error("Could not open output file");
-        }
+    LOG_DEBUG << "Codec context allocated:";
+    LOG_DEBUG << "    " << params.width << "x" << params.height
+              << " @ " << params.time_base.den << "/" << params.time_base.num << " fps"
+              << (params.variable_frame_rate ? ", variable frame rate" : "");
+    if (params.rate_control == EncoderParams::RateControl::CRF) {
+        LOG_DEBUG << "    crf " << params.crf << ", preset " << params.preset;
+    } else {
+        LOG_DEBUG << "    " << params.bit_rate << " bps, preset " << params.preset;
     }
+    LOG_DEBUG << "    " << threading_cstr(threading) << " threading, "
+              << (params.thread_count ? std::to_string(params.thread_count) : std::string("auto")) << " threads";
+}
 
-    /* Write file header */
-    if (avformat_write_header(output_format_context, nullptr) < 0) {
-        throw std::runtime_error("Could not write format header");
+
+void VideoEncoder::open(const EncoderParams &params) {
+    if (frame) {
+        throw std::runtime_error("Encoder is already open");
     }
 
-    AVFrame *frame = av_frame_alloc();
+    find_codec(params);
+    this->params = params;
+    input_linesize = params.input_linesize ? params.input_linesize : params.width * 2;
+
+    frame = av_frame_alloc();
     if (frame == nullptr) {
         throw std::runtime_error("Could not allocate frame");
     }
@@ -108,7 +234,7 @@ void VideoEncoder::render(const std::vector<Frame> &frames) {
     frame->width  = codec_context->width;
     frame->height = codec_context->height;
 
-    AVPacket *packet = av_packet_alloc();
+    packet = av_packet_alloc();
     if (packet == nullptr) {
         throw std::runtime_error("Could not allocate packet");
     }
@@ -118,103 +244,303 @@ void VideoEncoder::render(const std::vector<Frame> &frames) {
         throw std::runtime_error("Could not allocate the video frame buffer");
     }
 
-    LOG_DEBUG << "File " << filename << " open";
-    LOG_DEBUG << "Start rendering";
-
     LOG_DEBUG << "Frame:";
     LOG_DEBUG << "    size:     " << frame->width << "x" << frame->height;
     LOG_DEBUG << "    linesize: [" << frame->linesize[0]
               << ", " << frame->linesize[1] << ", " << frame->linesize[2] << "]";
+}
 
-    int i = 0;
-    for (Frame const &frame_data : frames) {
-        if (av_frame_make_writable(frame) < 0) {
-            throw std::runtime_error("Could not make frame writable");
+
+void VideoEncoder::open(const char *filename_, const EncoderParams &params) {
+    open(params);
+    open_file(filename_, codec_context);
+}
+
+
+void VideoEncoder::open(const char *filename_, const VideoEncoder &encoder) {
+    if (format_context || frame) {
+        throw std::runtime_error("Encoder is already open");
+    }
+    if (encoder.codec_context == nullptr) {
+        throw std::runtime_error("Muxer needs an open encoder for its stream parameters");
+    }
+
+    params = encoder.params;
+    open_file(filename_, encoder.codec_context);
+}
+
+
+void VideoEncoder::open_file(const char *filename_, const AVCodecContext *parameters) {
+    filename = filename_;
+
+    /* Prepare output file */
+    if (avformat_alloc_output_context2(&format_context, nullptr, "mp4", nullptr) < 0) {
+        throw std::runtime_error("Could not allocate output format context");
+    }
+
+    stream = avformat_new_stream(format_context, nullptr);
+    if (stream == nullptr) {
+        throw std::runtime_error("Could not create video stream in output format");
+    }
+
+    if (avcodec_parameters_from_context(stream->codecpar, parameters) < 0) {
+        throw std::runtime_error("Could not associate codec parameters with format");
+    }
+    packet_time_base = parameters->time_base;
+    stream->time_base = packet_time_base;
+
+    /* Create output file */
+    if (!(format_context->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&format_context->pb, filename_, AVIO_FLAG_WRITE) < 0) {
+            throw std::runtime_error("Could not open output file " + filename);
         }
+    }
 
-        /*
-         *  YUYV pixel layout:
-         *
-         *  [Y U Y V] - two pixels in a row
-         */
-        int i_data = 0;
-        for (int y = 0; y < codec_context->height; ++y) {
-            for (int x = 0, i_cb = 0, i_cr = 0; x < codec_context->width;) {
-                // Y channel
-                frame->data[0][y * frame->linesize[0] + x++] = frame_data.data[i_data++];
-                // Cb channel
-                frame->data[1][y * frame->linesize[1] + i_cb++] = frame_data.data[i_data++];
-                // Y channel
-                frame->data[0][y * frame->linesize[0] + x++] = frame_data.data[i_data++];
-                // Cr channel
-                frame->data[2][y * frame->linesize[2] + i_cr++] = frame_data.data[i_data++];
-            }
+    /* Write file header */
+    if (avformat_write_header(format_context, nullptr) < 0) {
+        throw std::runtime_error("Could not write format header");
+    }
+
+    LOG_DEBUG << "File " << filename << " open";
+    LOG_DEBUG << "Start rendering";
+}
+
+
+void VideoEncoder::push_frame(const uint8_t *data, size_t size, int64_t pts) {
+    if (frame == nullptr) {
+        throw std::runtime_error("Encoder is not open");
+    }
+
+    int src_linesize = input_linesize;
+    if (size < (size_t)src_linesize * (codec_context->height - 1) + codec_context->width * 2) {
+        LOG_ERROR << "Frame " << pts << " is too small (" << size << " bytes), skipped";
+        encoder_metrics().skipped.add();
+        return;
+    }
+
+    if (av_frame_make_writable(frame) < 0) {
+        throw std::runtime_error("Could not make frame writable");
+    }
+
+    /*
+     *  YUYV pixel layout:
+     *
+     *  [Y U Y V] - two pixels in a row
+     */
+    {
+        metrics::ScopedTimer timer(encoder_metrics().convert);
+        if (codec_context->pix_fmt == AV_PIX_FMT_YUV420P) {
+            yuyv::to_yuv420p(data, src_linesize, codec_context->width, codec_context->height,
+                             frame->data, frame->linesize);
+        } else {
+            yuyv::to_yuv422p(data, src_linesize, codec_context->width, codec_context->height,
+                             frame->data, frame->linesize);
         }
+    }
 
-        frame->pts = i++;
+    frame->pts = pts;
 
-        int err = avcodec_send_frame(codec_context, frame);
-        if (err == AVERROR(EAGAIN)) LOG_ERROR << "EAGAIN!!!";
-        if (err == AVERROR_EOF)     LOG_ERROR << "EVERROR_EOF!!!";
-        if (err == AVERROR(EINVAL)) LOG_ERROR << "EINVAL!!!";
-        if (err < 0) {
-            throw std::runtime_error("Could not send frame to the codec");
+    encode(frame);
+    encoder_metrics().frames.add();
+}
+
+
+void VideoEncoder::push_frame(const Frame &frame_data, int64_t pts) {
+    if (!frame_data.compressed()) {
+        push_frame(frame_data.data, frame_data.size, pts);
+        return;
+    }
+
+    AVFrame *picture = decode_jpeg(frame_data);
+    if (picture == nullptr) {
+        LOG_ERROR << "Frame " << pts << " is not a valid JPEG (" << frame_data.size << " bytes), skipped";
+        encoder_metrics().skipped.add();
+        return;
+    }
+
+    push_frame(picture, pts);
+    av_frame_unref(picture);
+}
+
+
+void VideoEncoder::push_frame(AVFrame *picture, int64_t pts) {
+    if (frame == nullptr) {
+        throw std::runtime_error("Encoder is not open");
+    }
+
+    if (picture->format == codec_context->pix_fmt
+            && picture->width == codec_context->width && picture->height == codec_context->height) {
+        // The codec takes a reference, no copy
+        picture->pts = pts;
+        encode(picture);
+        encoder_metrics().frames.add();
+        return;
+    }
+
+    if (av_frame_make_writable(frame) < 0) {
+        throw std::runtime_error("Could not make frame writable");
+    }
+
+    {
+        // MJPEG decodes to full range YUVJ, the codec wants limited range planes
+        metrics::ScopedTimer timer(encoder_metrics().convert);
+        scaler = sws_getCachedContext(scaler,
+            picture->width, picture->height, (AVPixelFormat) picture->format,
+            codec_context->width, codec_context->height, codec_context->pix_fmt,
+            SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (scaler == nullptr) {
+            throw std::runtime_error("Cannot convert decoded frames for the codec");
         }
 
-        LOG_DEBUG << "Sent frame " << frame->pts;
+        sws_scale(scaler, (const uint8_t *const *) picture->data, picture->linesize, 0, picture->height,
+                  frame->data, frame->linesize);
+    }
 
-        while (true) {
-            int err = avcodec_receive_packet(codec_context, packet);
-            if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) break;
-            if (err < 0) {
-                throw std::runtime_error("Could not receive packet");
-            }
+    frame->pts = pts;
 
-            LOG_DEBUG << "Write packet " << packet->pts << " size: " << packet->size;
+    encode(frame);
+    encoder_metrics().frames.add();
+}
 
-            /* rescale output packet timestamp values from codec to stream timebase */
-            av_packet_rescale_ts(packet, codec_context->time_base, out_video_stream->time_base);
-            packet->stream_index = out_video_stream->index;
 
-            if (av_interleaved_write_frame(output_format_context, packet) < 0) {
-                throw std::runtime_error("Could not write packet");
-            }
+void VideoEncoder::finish() {
+    if (frame == nullptr && format_context == nullptr) return;
 
-            av_packet_unref(packet);
+    // A muxer has no codec to flush
+    if (frame) encode(nullptr);
+
+    if (format_context) {
+        if (av_write_trailer(format_context) < 0) {
+            throw std::runtime_error("Could not write format trailer");
         }
 
+        LOG_DEBUG << "File " << filename << " saved";
+    }
+
+    close();
+}
+
+
+std::vector<AVPacket*> VideoEncoder::take_packets() {
+    std::vector<AVPacket*> result;
+    result.swap(packets);
+    return result;
+}
+
+
+void VideoEncoder::write_packet(AVPacket *packet) {
+    if (format_context == nullptr) {
+        throw std::runtime_error("Encoder has no output file");
+    }
+
+    /* rescale output packet timestamp values from codec to stream timebase */
+    av_packet_rescale_ts(packet, packet_time_base, stream->time_base);
+    packet->stream_index = stream->index;
+
+    int size = packet->size;
+    {
+        metrics::ScopedTimer timer(encoder_metrics().write);
+        if (av_interleaved_write_frame(format_context, packet) < 0) {
+            throw std::runtime_error("Could not write packet");
+        }
+    }
+    encoder_metrics().bytes.add(size);
+}
+
+
+void VideoEncoder::render(const std::vector<Frame> &frames, const char *filename_, const EncoderParams &params) {
+    open(filename_, params);
+
+    PtsClock clock(params);
+    size_t i = 0;
+    for (Frame const &frame_data : frames) {
+        push_frame(frame_data, clock.next(frame_data.timestamp_ns));
+        i++;
+
         if (i % 10 == 0) {
             LOG_DEBUG << "Progress " << i * 100.0 / frames.size() << "%";
         }
     }
 
-    if (avcodec_send_frame(codec_context, nullptr) < 0) {
-        throw std::runtime_error("Could not flush nullptr to the codec");
-    }
+    finish();
+}
+
 
-    if (avcodec_receive_packet(codec_context, packet) < 0) {
-        throw std::runtime_error("Could not receive packet");
+/*
+ *  Sends frame to the codec (nullptr flushes it) and muxes every packet
+ *  the codec has ready after that, or keeps them when there is no file.
+ */
+void VideoEncoder::encode(AVFrame *frame) {
+    // Only the codec calls are timed, muxing has its own histogram
+    using Clock = std::chrono::steady_clock;
+    Clock::duration codec_time{};
+    Clock::time_point t0 = Clock::now();
+
+    int err = avcodec_send_frame(codec_context, frame);
+    codec_time += Clock::now() - t0;
+    if (err == AVERROR(EAGAIN)) LOG_ERROR << "EAGAIN!!!";
+    if (err == AVERROR_EOF)     LOG_ERROR << "EVERROR_EOF!!!";
+    if (err == AVERROR(EINVAL)) LOG_ERROR << "EINVAL!!!";
+    if (err < 0) {
+        throw std::runtime_error("Could not send frame to the codec");
     }
 
-    LOG_DEBUG << "Write packet " << packet->pts << " size: " << packet->size;
+    if (frame) LOG_DEBUG << LOG_LIT("Sent frame ") << frame->pts;
 
-    if (av_interleaved_write_frame(output_format_context, packet) < 0) {
-        throw std::runtime_error("Could not write packet");
-    }
+    while (true) {
+        t0 = Clock::now();
+        int err = avcodec_receive_packet(codec_context, packet);
+        codec_time += Clock::now() - t0;
+        if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) break;
+        if (err < 0) {
+            throw std::runtime_error("Could not receive packet");
+        }
 
-    if (av_write_trailer(output_format_context) < 0) {
-        throw std::runtime_error("Could not write format trailer");
+        if (format_context) {
+            LOG_DEBUG << LOG_LIT("Write packet ") << packet->pts << LOG_LIT(" size: ") << packet->size;
+            write_packet(packet);
+            av_packet_unref(packet);
+        } else {
+            AVPacket *kept = av_packet_alloc();
+            if (kept == nullptr) {
+                throw std::runtime_error("Could not allocate packet");
+            }
+            av_packet_move_ref(kept, packet);
+            packets.push_back(kept);
+        }
     }
 
-    if (output_format_context && !(output_format_context->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&output_format_context->pb);
+    encoder_metrics().encode.record(std::chrono::duration_cast<std::chrono::nanoseconds>(codec_time).count());
+}
+
+
+/* Returns the decoded picture, valid until the next call, or nullptr if jpeg is corrupt */
+AVFrame *VideoEncoder::decode_jpeg(const Frame &jpeg) {
+    if (jpeg_picture == nullptr) {
+        jpeg_picture = av_frame_alloc();
+        if (jpeg_picture == nullptr) {
+            throw std::runtime_error("Could not allocate MJPEG decoder");
+        }
     }
+    if (jpeg_decoder == nullptr) jpeg_decoder = new JpegContext;
+
+    return jpeg_decoder->decode(jpeg.data, jpeg.size, jpeg_picture) ? jpeg_picture : nullptr;
+}
 
-    LOG_DEBUG << "File " << filename << " saved";
 
-    avformat_free_context(output_format_context);
+void VideoEncoder::close() {
+    if (format_context && !(format_context->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&format_context->pb);
+    }
+
+    avformat_free_context(format_context);
     av_frame_free(&frame);
     av_packet_free(&packet);
+    sws_freeContext(scaler);
+
+    scaler = nullptr;
+    format_context = nullptr;
+    stream = nullptr;
 }
 
 }
@@ -1,26 +1,159 @@
 #pragma once
 
+#include <string>
 #include <vector>
 #include <frame.h>
+#include <frame_source.h>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
 }
 
 
 namespace my {
 
+struct JpegContext;
+
+/*
+ *  Everything that decides how frames are encoded. Size and time base
+ *  should come from the capture device, see from_source(); the rest is
+ *  a per-deployment trade between encode speed and file size.
+ */
+struct EncoderParams {
+    enum class RateControl {
+        CRF,      // constant quality, crf
+        Bitrate,  // average bit_rate
+    };
+
+    /*
+     *  Frame threading encodes several frames at once: best throughput,
+     *  but every thread adds a frame of delay. Slice threading splits each
+     *  frame between threads, so output latency stays at one frame.
+     */
+    enum class Threading {
+        Auto,     // slices for Live, frames for Offline
+        Frame,
+        Slice,
+    };
+
+    enum class Latency {
+        Offline,  // maximum throughput, rendering archives
+        Live,     // every frame out as soon as possible, no B-frames
+    };
+
+    std::string codec{"libx264"};  // encoder name, as in ffmpeg -c:v
+
+    int width{640};
+    int height{480};
+    int input_linesize{0};         // bytes per YUYV row, 0 means width * 2
+    AVRational time_base{1, 30};   // duration of one output frame
+    int64_t capture_interval_ns{0};  // capture time one output frame stands for, 0 means time_base (real time)
+    bool variable_frame_rate{false}; // pts straight from capture timestamps in a 1/90000 time base
+    AVPixelFormat pixel_format{AV_PIX_FMT_YUV422P};
+
+    RateControl rate_control{RateControl::Bitrate};
+    int crf{23};
+    int64_t bit_rate{400000};
+
+    std::string preset{"slow"};    // codec private option, empty to keep default
+    std::string tune;              // codec private option, empty to keep default
+
+    int gop_size{10};
+    int max_b_frames{1};
+
+    Latency latency{Latency::Offline};
+    Threading threading{Threading::Auto};
+    int thread_count{0};           // 0 lets the codec decide
+    int lookahead_threads{0};      // x264 only, 0 lets the codec decide
+
+    static EncoderParams from_source(const FrameSource &source);
+    // Size and time base from the source, everything else from params
+    static EncoderParams from_source(const FrameSource &source, EncoderParams params);
+
+    // time_base, or the 1/90000 clock with variable_frame_rate
+    AVRational codec_time_base() const;
+};
+
+/*
+ *  Turns capture timestamps into pts. Output time is capture time since
+ *  the first frame, scaled by time_base / capture_interval_ns, so a
+ *  timelapse keeps its speed-up and frames the driver dropped leave a gap.
+ *  Every pts is computed from the first timestamp, never by adding up
+ *  intervals, so multi-day captures do not drift. A frame without a
+ *  timestamp comes one frame after the previous one, and pts always grow.
+ */
+struct PtsClock {
+    explicit PtsClock(const EncoderParams &params);
+
+    int64_t next(int64_t timestamp_ns);
+
+private:
+    int64_t frame_duration;        // one output frame in codec time base units
+    int64_t capture_interval_ns;
+    int64_t origin_ns{0};          // first timestamp, 0 until one arrives
+    int64_t origin_pts{0};
+    int64_t last{-1};
+};
+
+/*
+ *  Encodes YUYV frames one at a time:
+ *
+ *      encoder.open("data/output.mp4", params);
+ *      encoder.push_frame(frame, pts);  // as frames arrive
+ *      encoder.finish();                // flushes the codec, writes trailer
+ *
+ *  Opened without a file name, the encoder keeps encoded packets in memory
+ *  until take_packets(); write_packet() muxes such packets into a file,
+ *  also from a muxer opened on that encoder, which has no codec of its own.
+ *
+ *  Compressed frames (Frame::compressed()) are decoded here, right before
+ *  encoding, so archives of MJPEG frames are held at JPEG size.
+ */
 struct VideoEncoder {
     AVCodecContext *codec_context{nullptr};
-    AVCodec *codec{nullptr};
+    const AVCodec *codec{nullptr};
+
+    AVFormatContext *format_context{nullptr};
+    AVStream *stream{nullptr};
+    AVFrame *frame{nullptr};
+    AVPacket *packet{nullptr};
+    SwsContext *scaler{nullptr};  // converts decoded frames the codec cannot take as they are
+    JpegContext *jpeg_decoder{nullptr};  // opened by the first compressed frame
+    AVFrame *jpeg_picture{nullptr};
+    std::string filename;
+    AVRational packet_time_base{1, 1};  // of the packets write_packet() gets
+    EncoderParams params;          // what the encoder was last opened with
+    int input_linesize{0};
+    std::vector<AVPacket*> packets;
 
     VideoEncoder();
+    VideoEncoder(const VideoEncoder &) = delete;
     ~VideoEncoder();
 
-    void find_codec(const char *name);
-    void render(const std::vector<Frame> &);
-    void save_to(const char *filename);
+    void find_codec(const EncoderParams &params);
+
+    void open(const EncoderParams &params);
+    void open(const char *filename, const EncoderParams &params);
+    // Muxer only: no codec of its own, the stream takes encoder's codec parameters
+    void open(const char *filename, const VideoEncoder &encoder);
+    void push_frame(const uint8_t *data, size_t size, int64_t pts);
+    void push_frame(const Frame &frame, int64_t pts);
+    // Decoded picture in any size and pixel format, sent as is when it matches the codec
+    void push_frame(AVFrame *picture, int64_t pts);
+    void finish();
+
+    std::vector<AVPacket*> take_packets();
+    void write_packet(AVPacket *packet);
+
+    void render(const std::vector<Frame> &, const char *filename, const EncoderParams &params);
+
+private:
+    void open_file(const char *filename, const AVCodecContext *parameters);
+    void encode(AVFrame *frame);
+    AVFrame *decode_jpeg(const Frame &jpeg);
+    void close();
 };
 
 }
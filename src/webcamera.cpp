@@ -1,48 +1,125 @@
 #include <webcamera.h>
 #include <logging.h>
+#include <metrics.h>
 
 #include <stdio.h>
 #include <unistd.h>
 
 #include <fcntl.h>
+#include <linux/dma-buf.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <cerrno>
+#include <ctime>
 
+#include <algorithm>
 #include <stdexcept>
+#include <string>
 
 
 namespace my {
 
-enum IOMethod {
-    IO_METHOD_READ,
-    IO_METHOD_MMAP,
-    IO_METHOD_USERPTR,
+struct CaptureMetrics {
+    metrics::Histogram &dqbuf = metrics::registry().histogram(
+        "timelapser_capture_dqbuf_seconds", "Time blocked in VIDIOC_DQBUF");
+    metrics::Counter &frames = metrics::registry().counter(
+        "timelapser_capture_frames_total", "Frames dequeued from the camera");
+    metrics::Counter &dropped = metrics::registry().counter(
+        "timelapser_capture_dropped_frames_total", "Frames the driver dropped, from sequence gaps");
+    metrics::Counter &bytes = metrics::registry().counter(
+        "timelapser_capture_bytes_total", "Bytes dequeued from the camera");
 };
 
-static IOMethod io = IO_METHOD_MMAP;
-
+static CaptureMetrics &capture_metrics() {
+    static CaptureMetrics instance;
+    return instance;
+}
 
 
-WebCamera::FrameBuffer::FrameBuffer(uint8_t *data, size_t size)
+WebCamera::FrameBuffer::FrameBuffer(uint8_t *data, size_t size, FramePool *pool)
     : start(data)
     , size(size)
+    , pool(pool)
 {}
 
 WebCamera::FrameBuffer::~FrameBuffer() {
-    if (munmap(start, size) < 0) {
+    if (pool) {
+        pool->release(start);
+    } else if (start && munmap(start, size) < 0) {
         LOG_ERROR << "Cannot unmap memory";
     }
+
+    if (dmabuf >= 0) close(dmabuf);
 }
 
 WebCamera::FrameBuffer::FrameBuffer(FrameBuffer &&other) {
     start = other.start;
     size = other.size;
+    leased = other.leased;
+    pool = other.pool;
+    dmabuf = other.dmabuf;
 
     other.start = nullptr;
     other.size = 0;
+    other.pool = nullptr;
+    other.dmabuf = -1;
+}
+
+
+const char *io_method_cstr(WebCamera::IOMethod method) {
+    switch (method) {
+        case WebCamera::IOMethod::Read:    return "read";
+        case WebCamera::IOMethod::MMAP:    return "mmap";
+        case WebCamera::IOMethod::UserPtr: return "userptr";
+        case WebCamera::IOMethod::DMABuf:  return "dmabuf";
+        default: return "unknown";
+    }
+}
+
+CameraSpec parse_camera_spec(const std::string &spec) {
+    CameraSpec parsed;
+    parsed.device = spec.substr(0, spec.find(':'));
+
+    for (size_t begin = parsed.device.size() + 1, end; begin < spec.size(); begin = end + 1) {
+        end = std::min(spec.find(':', begin), spec.size());
+        std::string option = spec.substr(begin, end - begin);
+
+        if (option == "read") parsed.io = WebCamera::IOMethod::Read;
+        else if (option == "userptr") parsed.io = WebCamera::IOMethod::UserPtr;
+        else if (option == "mmap") parsed.io = WebCamera::IOMethod::MMAP;
+        else if (option == "dmabuf") {
+            throw std::runtime_error("DMABuf capture needs dma-buf descriptors, use init_buffers() instead of " + spec);
+        }
+        else if (sscanf(option.c_str(), "%ux%u", &parsed.requirements.max_width, &parsed.requirements.max_height) != 2) {
+            throw std::runtime_error("Unknown option " + option + " in source " + spec);
+        }
+    }
+
+    return parsed;
+}
+
+static uint32_t memory_of(WebCamera::IOMethod method) {
+    switch (method) {
+        case WebCamera::IOMethod::MMAP:    return V4L2_MEMORY_MMAP;
+        case WebCamera::IOMethod::UserPtr: return V4L2_MEMORY_USERPTR;
+        case WebCamera::IOMethod::DMABuf:  return V4L2_MEMORY_DMABUF;
+        default: return 0;
+    }
+}
+
+/* CPU reads of a dma-buf are bracketed so caches stay coherent with the device */
+static void sync_dmabuf(int fd, uint64_t flags) {
+    dma_buf_sync sync{};
+    sync.flags = flags | DMA_BUF_SYNC_READ;
+
+    if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+        LOG_WARNING << "Cannot sync dma-buf, DMA_BUF_IOCTL_SYNC";
+    }
 }
 
 
@@ -63,17 +140,50 @@ const char *pixel_format_cstr(int fmt) {
     }
 }
 
+/* Takes the negotiated format and the frame interval that goes with it */
+static void store_format(WebCamera *camera, const v4l2_format &image_format) {
+    Format &format = camera->format;
+
+    LOG_DEBUG << "Negotiated image format:";
+    LOG_DEBUG << "    Resolution: " << image_format.fmt.pix.width << "x" << image_format.fmt.pix.height;
+    LOG_DEBUG << "    Pixel format: " << pixel_format_cstr(image_format.fmt.pix.pixelformat);
+    LOG_DEBUG << "    Image size: " << image_format.fmt.pix.sizeimage << " bytes";
+
+    format.width = image_format.fmt.pix.width;
+    format.height = image_format.fmt.pix.height;
+    format.pixel_format = image_format.fmt.pix.pixelformat;
+    format.bytes_per_line = image_format.fmt.pix.bytesperline;
+    format.image_size = image_format.fmt.pix.sizeimage;
+
+    camera->frame_pool.set_buffer_size(image_format.fmt.pix.sizeimage);
+
+    v4l2_streamparm parm{};
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (ioctl(camera->descriptor, VIDIOC_G_PARM, &parm) < 0) {
+        LOG_WARNING << "Cannot get stream parameters, assuming "
+                    << format.interval_numerator << "/" << format.interval_denominator << "s per frame";
+    } else if (parm.parm.capture.timeperframe.numerator && parm.parm.capture.timeperframe.denominator) {
+        format.interval_numerator = parm.parm.capture.timeperframe.numerator;
+        format.interval_denominator = parm.parm.capture.timeperframe.denominator;
+    }
+
+    LOG_DEBUG << "    Time per frame: "
+              << format.interval_numerator << "/" << format.interval_denominator << "s";
+}
+
 WebCamera::~WebCamera() {
     if (state == State::StreamON) stop();
     if (descriptor) { close(descriptor); }
 }
 
-void WebCamera::open(const char *device) {
+void WebCamera::open(const char *device, bool nonblocking_) {
 
     {
-        descriptor = ::open(device, O_RDWR);
+        nonblocking = nonblocking_;
+        descriptor = ::open(device, O_RDWR | (nonblocking ? O_NONBLOCK : 0));
         if (descriptor < 0) {
-            throw std::runtime_error("Web camera /dev/video0 not found");
+            throw std::runtime_error(std::string("Web camera ") + device + " not found");
         }
 
         LOG_INFO << "Device " << device << " open";
@@ -86,7 +196,18 @@ void WebCamera::open(const char *device) {
             throw std::runtime_error("Failed to get device capabilities, VIDIOC_QUERYCAP");
         }
 
-        LOG_DEBUG << "Capabilities negotiated";
+        // Capabilities of this node when the device has several, of the whole device otherwise
+        capabilities = (capability.capabilities & V4L2_CAP_DEVICE_CAPS)
+            ? capability.device_caps : capability.capabilities;
+
+        if (!(capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+            throw std::runtime_error(std::string("Device ") + device + " cannot capture video");
+        }
+
+        LOG_DEBUG << "Capabilities negotiated:";
+        LOG_DEBUG << "    Card: " << (const char*) capability.card << ", bus " << (const char*) capability.bus_info;
+        LOG_DEBUG << "    Streaming: " << bool(capabilities & V4L2_CAP_STREAMING)
+                  << ", read(): " << bool(capabilities & V4L2_CAP_READWRITE);
     }
 
     {
@@ -98,38 +219,226 @@ void WebCamera::open(const char *device) {
             throw std::runtime_error("Device could not get image format");
         }
 
-        // image_format.fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
-        // image_format.fmt.pix.width = 1600;
-        // image_format.fmt.pix.height = 900;
+        store_format(this, image_format);
+    }
+
+    enumerate_modes();
+}
+
+void WebCamera::enumerate_modes() {
+    modes.clear();
+
+    v4l2_fmtdesc description{};
+    description.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (description.index = 0; ioctl(descriptor, VIDIOC_ENUM_FMT, &description) == 0; ++description.index) {
+        Mode mode;
+        mode.pixel_format = description.pixelformat;
+
+        std::vector<std::pair<uint32_t, uint32_t>> sizes;
+        v4l2_frmsizeenum size{};
+        size.pixel_format = description.pixelformat;
+
+        for (size.index = 0; ioctl(descriptor, VIDIOC_ENUM_FRAMESIZES, &size) == 0; ++size.index) {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                sizes.emplace_back(size.discrete.width, size.discrete.height);
+            } else {
+                // Stepwise and continuous ranges come as one entry, their ends stand for them
+                sizes.emplace_back(size.stepwise.min_width, size.stepwise.min_height);
+                sizes.emplace_back(size.stepwise.max_width, size.stepwise.max_height);
+                break;
+            }
+        }
+
+        for (auto &wh : sizes) {
+            mode.width = wh.first;
+            mode.height = wh.second;
+
+            v4l2_frmivalenum interval{};
+            interval.pixel_format = description.pixelformat;
+            interval.width = mode.width;
+            interval.height = mode.height;
+
+            for (interval.index = 0; ioctl(descriptor, VIDIOC_ENUM_FRAMEINTERVALS, &interval) == 0; ++interval.index) {
+                if (interval.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+                    mode.interval_numerator = interval.discrete.numerator;
+                    mode.interval_denominator = interval.discrete.denominator;
+                    modes.push_back(mode);
+                } else {
+                    mode.interval_numerator = interval.stepwise.min.numerator;
+                    mode.interval_denominator = interval.stepwise.min.denominator;
+                    modes.push_back(mode);
+                    mode.interval_numerator = interval.stepwise.max.numerator;
+                    mode.interval_denominator = interval.stepwise.max.denominator;
+                    modes.push_back(mode);
+                    break;
+                }
+            }
+        }
+
+        LOG_DEBUG << "    " << (const char*) description.description << ": " << sizes.size() << " frame sizes";
+    }
+
+    LOG_DEBUG << "Device advertises " << modes.size() << " modes";
+}
+
+/* mode takes longer per frame than numerator/denominator seconds */
+static bool slower(const WebCamera::Mode &a, uint32_t numerator, uint32_t denominator) {
+    return uint64_t(a.interval_numerator) * denominator > uint64_t(numerator) * a.interval_denominator;
+}
+
+/* Bytes per second a mode puts on the bus, for MJPEG a guess of 4:1 over YUYV */
+static uint64_t bandwidth_of(const WebCamera::Mode &mode) {
+    uint64_t frame = uint64_t(mode.width) * mode.height * 2;
+    if (is_compressed(mode.pixel_format)) frame /= 4;
+
+    return frame * mode.interval_denominator / mode.interval_numerator;
+}
+
+bool WebCamera::auto_configure(const Requirements &requirements) {
+    const Mode *best = nullptr;
+    size_t best_rank = 0;
+
+    for (const Mode &mode : modes) {
+        auto preference = std::find(requirements.pixel_formats.begin(), requirements.pixel_formats.end(),
+                                    mode.pixel_format);
+        if (preference == requirements.pixel_formats.end()) continue;
+        if (mode.width > requirements.max_width || mode.height > requirements.max_height) continue;
+        if (mode.interval_numerator == 0 || mode.interval_denominator == 0) continue;
+        if (slower(mode, requirements.interval_numerator, requirements.interval_denominator)) continue;
+        if (bandwidth_of(mode) > requirements.bandwidth) continue;
+
+        size_t rank = preference - requirements.pixel_formats.begin();
+        uint64_t area = uint64_t(mode.width) * mode.height;
+
+        if (best) {
+            uint64_t best_area = uint64_t(best->width) * best->height;
+            if (area != best_area) {
+                if (area < best_area) continue;
+            } else if (rank != best_rank) {
+                if (rank > best_rank) continue;
+            } else if (!slower(mode, best->interval_numerator, best->interval_denominator)) {
+                // Same picture, the slower rate is cheaper on the bus
+                continue;
+            }
+        }
+
+        best = &mode;
+        best_rank = rank;
+    }
+
+    if (best == nullptr) {
+        LOG_WARNING << "None of " << modes.size() << " camera modes fits " << requirements.interval_numerator
+                    << "/" << requirements.interval_denominator << "s per frame in "
+                    << requirements.bandwidth << " bytes/s, keeping the current format";
+        return false;
+    }
+
+    Mode chosen = *best;
+    LOG_INFO << "Chose " << pixel_format_cstr(chosen.pixel_format) << " " << chosen.width << "x" << chosen.height
+             << " at " << chosen.interval_numerator << "/" << chosen.interval_denominator
+             << "s per frame, about " << bandwidth_of(chosen) / 1000 << " kB/s";
+
+    if (!set_format(chosen.width, chosen.height, {chosen.pixel_format})) return false;
+    set_interval(chosen.interval_numerator, chosen.interval_denominator);
+    return true;
+}
+
+void WebCamera::set_interval(uint32_t numerator, uint32_t denominator) {
+    v4l2_streamparm parm{};
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (ioctl(descriptor, VIDIOC_G_PARM, &parm) < 0 || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        LOG_WARNING << "Device cannot change its frame interval";
+        return;
+    }
+
+    parm.parm.capture.timeperframe.numerator = numerator;
+    parm.parm.capture.timeperframe.denominator = denominator;
+
+    if (ioctl(descriptor, VIDIOC_S_PARM, &parm) < 0) {
+        LOG_WARNING << "Cannot set frame interval, VIDIOC_S_PARM";
+        return;
+    }
+
+    if (parm.parm.capture.timeperframe.numerator && parm.parm.capture.timeperframe.denominator) {
+        format.interval_numerator = parm.parm.capture.timeperframe.numerator;
+        format.interval_denominator = parm.parm.capture.timeperframe.denominator;
+    }
+
+    LOG_DEBUG << "    Time per frame: "
+              << format.interval_numerator << "/" << format.interval_denominator << "s";
+}
+
+bool WebCamera::set_format(uint32_t width, uint32_t height, const std::vector<uint32_t> &pixel_formats) {
+    if (!buffers.empty()) {
+        throw std::runtime_error("Image format must be set before init_buffers()");
+    }
+
+    v4l2_format image_format{};
+    image_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (uint32_t pixel_format : pixel_formats) {
+        image_format.fmt.pix.width = width;
+        image_format.fmt.pix.height = height;
+        image_format.fmt.pix.pixelformat = pixel_format;
+        image_format.fmt.pix.field = V4L2_FIELD_ANY;
+
+        if (ioctl(descriptor, VIDIOC_S_FMT, &image_format) < 0) {
+            LOG_WARNING << "Device refused " << pixel_format_cstr(pixel_format) << " " << width << "x" << height;
+            continue;
+        }
+
+        // Drivers answer with the nearest format they can deliver instead of failing
+        if (image_format.fmt.pix.pixelformat != pixel_format) {
+            LOG_DEBUG << "Device has no " << pixel_format_cstr(pixel_format) << " at " << width << "x" << height;
+            continue;
+        }
+        if (image_format.fmt.pix.width != width || image_format.fmt.pix.height != height) {
+            LOG_WARNING << "Asked for " << width << "x" << height << ", device gave "
+                        << image_format.fmt.pix.width << "x" << image_format.fmt.pix.height;
+        }
 
-        // if (ioctl(descriptor, VIDIOC_S_FMT, &image_format) < 0) {
-        //     throw std::runtime_error("Device could not get image format");
-        // }
+        store_format(this, image_format);
+        return true;
+    }
 
-        LOG_DEBUG << "Negotiated image format:";
-        LOG_DEBUG << "    Resolution: " << image_format.fmt.pix.width << "x" << image_format.fmt.pix.height;
-        LOG_DEBUG << "    Pixel format: " << pixel_format_cstr(image_format.fmt.pix.pixelformat);
-        LOG_DEBUG << "    Image size: " << image_format.fmt.pix.sizeimage << " bytes";
+    // A refused attempt may still have switched the device, keep format in sync with it
+    if (ioctl(descriptor, VIDIOC_G_FMT, &image_format) < 0) {
+        throw std::runtime_error("Device could not get image format");
     }
+    store_format(this, image_format);
+    return false;
 }
 
-void init_mmap(WebCamera *camera, size_t n) {
-    v4l2_requestbuffers request;
+/* Returns how many buffers the driver agreed to, asking for none frees them */
+static uint32_t request_buffers(WebCamera *camera, uint32_t memory, size_t n) {
+    v4l2_requestbuffers request{};
     request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    request.memory = V4L2_MEMORY_MMAP;
+    request.memory = memory;
     request.count = n;
 
     if (ioctl(camera->descriptor, VIDIOC_REQBUFS, &request) < 0) {
         throw std::runtime_error("Could not request buffer from device, VIDIOC_REQBUFS");
     }
+    if (n == 0) return 0;
 
-    if (request.count < n) {
+    // The driver may give fewer or more than asked, two are needed to capture while one is read
+    if (request.count < 2) {
         throw std::runtime_error("Insufficient buffer memory");
     }
+    if (request.count != n) {
+        LOG_WARNING << "Asked for " << n << " capture buffers, driver gave " << request.count;
+    }
 
-    camera->buffers.reserve(request.count);
+    return request.count;
+}
 
-    for (unsigned i = 0; i < request.count; ++i) {
+static void init_mmap(WebCamera *camera, size_t n) {
+    uint32_t count = request_buffers(camera, V4L2_MEMORY_MMAP, n);
+    camera->buffers.reserve(count);
+
+    for (unsigned i = 0; i < count; ++i) {
         v4l2_buffer buffer{};
         buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buffer.memory = V4L2_MEMORY_MMAP;
@@ -151,41 +460,207 @@ void init_mmap(WebCamera *camera, size_t n) {
     }
 }
 
-void WebCamera::init_buffers(size_t n) {
-    if (io == IO_METHOD_MMAP) {
-        init_mmap(this, n);
-    } else {
-        throw std::runtime_error("No IOMethod provided");
+static void init_userptr(WebCamera *camera, size_t n) {
+    uint32_t count = request_buffers(camera, V4L2_MEMORY_USERPTR, n);
+    camera->buffers.reserve(count);
+
+    // The driver pins the pages it captures into, so buffers are whole pages.
+    // take() hands them to frames and refills the slot from the pool.
+    camera->frame_pool.set_buffer_size(camera->format.image_size, count, sysconf(_SC_PAGESIZE));
+
+    for (unsigned i = 0; i < count; ++i) {
+        uint8_t *memory = camera->frame_pool.acquire(camera->format.image_size);
+        if (memory == nullptr) {
+            throw std::runtime_error("Could not get a pool buffer for USERPTR capture");
+        }
+
+        camera->buffers.emplace_back(memory, camera->frame_pool.buffer_size(), &camera->frame_pool);
     }
 }
 
-void WebCamera::start() {
-    if (io == IO_METHOD_MMAP) {
+static void init_dmabuf(WebCamera *camera, size_t n, const std::vector<int> &dmabufs) {
+    if (dmabufs.size() < n) {
+        throw std::runtime_error("Need a dma-buf descriptor for every buffer to import");
+    }
 
-        for (size_t i = 0; i < buffers.size(); ++i) {
-            v4l2_buffer buffer;
-            buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buffer.memory = V4L2_MEMORY_MMAP;
-            buffer.index = i;
+    uint32_t count = request_buffers(camera, V4L2_MEMORY_DMABUF, n);
+    if (count > dmabufs.size()) {
+        throw std::runtime_error("Driver wants more buffers than there are dma-bufs to import");
+    }
+    camera->buffers.reserve(count);
+
+    for (unsigned i = 0; i < count; ++i) {
+        int fd = dup(dmabufs[i]);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot duplicate dma-buf descriptor");
+        }
+
+        // The device writes the dma-buf, the process reads it through a mapping
+        off_t length = lseek(fd, 0, SEEK_END);
+        void *memory = length >= (off_t) camera->format.image_size
+            ? mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
 
-            if (ioctl(descriptor, VIDIOC_QBUF, &buffer) < 0) {
-                throw std::runtime_error("Cannot queue buffer");
+        if (memory == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Cannot map dma-buf, too small for the image or not mappable");
+        }
+
+        camera->buffers.emplace_back((uint8_t*)memory, length);
+        camera->buffers.back().dmabuf = fd;
+    }
+}
+
+static void init_read(WebCamera *camera, size_t n) {
+    if (!(camera->capabilities & V4L2_CAP_READWRITE)) {
+        throw std::runtime_error("Device does not support read()");
+    }
+
+    // read() copies into any memory, pool buffers save mapping anything
+    camera->buffers.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t *memory = camera->frame_pool.acquire(camera->format.image_size);
+        if (memory == nullptr) {
+            throw std::runtime_error("Could not get a pool buffer for read() capture");
+        }
+
+        camera->buffers.emplace_back(memory, camera->frame_pool.buffer_size(), &camera->frame_pool);
+    }
+}
+
+void WebCamera::init_buffers(size_t n, IOMethod method, const std::vector<int> &dmabufs) {
+    if (state == State::StreamON) {
+        throw std::runtime_error("Cannot change capture buffers while streaming");
+    }
+
+    std::vector<IOMethod> chain{method};
+    for (IOMethod fallback : {IOMethod::MMAP, IOMethod::Read}) {
+        if (fallback != method) chain.push_back(fallback);
+    }
+
+    release_buffers();
+
+    for (size_t i = 0; i < chain.size(); ++i) {
+        io = chain[i];
+
+        try {
+            if (io != IOMethod::Read && !(capabilities & V4L2_CAP_STREAMING)) {
+                throw std::runtime_error("Device does not support streaming I/O");
             }
+
+            switch (io) {
+                case IOMethod::Read:    init_read(this, n); break;
+                case IOMethod::MMAP:    init_mmap(this, n); break;
+                case IOMethod::UserPtr: init_userptr(this, n); break;
+                case IOMethod::DMABuf:  init_dmabuf(this, n, dmabufs); break;
+            }
+
+            LOG_INFO << "Capturing with " << io_method_cstr(io) << " I/O into " << buffers.size() << " buffers";
+            return;
+        } catch (const std::exception &e) {
+            release_buffers();
+            if (i + 1 == chain.size()) throw;
+
+            LOG_WARNING << "Cannot use " << io_method_cstr(io) << " I/O (" << e.what()
+                        << "), falling back to " << io_method_cstr(chain[i + 1]);
+        }
+    }
+}
+
+void WebCamera::release_buffers() {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+
+    for (const FrameBuffer &buffer : buffers) {
+        if (buffer.leased) throw std::runtime_error("Cannot free capture buffers while frames are leased");
+    }
+    buffers.clear();
+
+    if (io != IOMethod::Read) {
+        try {
+            request_buffers(this, memory_of(io), 0);
+        } catch (const std::exception &) {
+            // Nothing was allocated with this method
+        }
+    }
+}
+
+int WebCamera::export_buffer(uint32_t index) {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+
+    if (io != IOMethod::MMAP) {
+        throw std::runtime_error("Only MMAP buffers can be exported as dma-buf");
+    }
+
+    FrameBuffer &frame_buffer = buffers.at(index);
+    if (frame_buffer.dmabuf >= 0) return frame_buffer.dmabuf;
+
+    v4l2_exportbuffer request{};
+    request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    request.index = index;
+    request.flags = O_RDONLY | O_CLOEXEC;
+
+    if (ioctl(descriptor, VIDIOC_EXPBUF, &request) < 0) {
+        throw std::runtime_error("Cannot export buffer, VIDIOC_EXPBUF");
+    }
+
+    frame_buffer.dmabuf = request.fd;
+    return frame_buffer.dmabuf;
+}
+
+/* Hands buffer index to the driver, buffers_mutex must be held */
+void WebCamera::queue(uint32_t index) {
+    // read() has nothing to queue, it fills whatever buffer it is given
+    if (io == IOMethod::Read) return;
+
+    FrameBuffer &frame_buffer = buffers[index];
+
+    v4l2_buffer buffer{};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = memory_of(io);
+    buffer.index = index;
+
+    if (io == IOMethod::UserPtr) {
+        buffer.m.userptr = (unsigned long) frame_buffer.start;
+        buffer.length = frame_buffer.size;
+    } else if (io == IOMethod::DMABuf) {
+        buffer.m.fd = frame_buffer.dmabuf;
+        buffer.length = frame_buffer.size;
+    }
+
+    if (ioctl(descriptor, VIDIOC_QBUF, &buffer) < 0) {
+        throw std::runtime_error("Cannot queue buffer");
+    }
+}
+
+void WebCamera::start() {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+
+    if (io != IOMethod::Read) {
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            // Leased buffers are queued when their lease is released
+            if (!buffers[i].leased) queue(i);
         }
 
         v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         if (ioctl(descriptor, VIDIOC_STREAMON, &type) < 0) {
+            // USB controllers refuse a stream whose isochronous bandwidth they cannot reserve
+            if (errno == ENOSPC) {
+                throw std::runtime_error("Not enough USB bandwidth to start the camera, lower resolution or frame rate");
+            }
             throw std::runtime_error("Cannot start video stream from camera");
         }
     }
 
+    // Sequence numbers start over with every STREAMON
+    last_sequence = -1;
     state = State::StreamON;
     LOG_INFO << "Camera video stream started";
 }
 
 void WebCamera::stop() {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+
     v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(descriptor, VIDIOC_STREAMOFF, &type) < 0) {
+    if (io != IOMethod::Read && ioctl(descriptor, VIDIOC_STREAMOFF, &type) < 0) {
         throw std::runtime_error("Cannot stop video stream from camera");
     }
 
@@ -193,27 +668,166 @@ void WebCamera::stop() {
     LOG_INFO << "Camera video stream stopped";
 }
 
-Frame WebCamera::get_frame() {
-    v4l2_buffer buffer;
+/* False if the descriptor is non-blocking and no buffer is filled yet */
+bool WebCamera::dequeue(FrameLease &lease) {
+    if (io == IOMethod::Read) return read_frame(lease);
 
-    if (io == IO_METHOD_MMAP) {
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
+    v4l2_buffer buffer{};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = memory_of(io);
 
+    {
+        metrics::ScopedTimer timer(capture_metrics().dqbuf);
         if (ioctl(descriptor, VIDIOC_DQBUF, &buffer) < 0) {
+            if (errno == EAGAIN) return false;
             throw std::runtime_error("Failed dequeue buffer");
         }
+    }
+
+    // The driver counts every frame it captured, holes are frames it had no buffer for
+    if (last_sequence >= 0 && buffer.sequence > last_sequence + 1) {
+        capture_metrics().dropped.add(buffer.sequence - last_sequence - 1);
+    }
+    last_sequence = buffer.sequence;
+    capture_metrics().frames.add();
+    capture_metrics().bytes.add(buffer.bytesused);
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    FrameBuffer &frame_buffer = buffers[buffer.index];
+    frame_buffer.leased = true;
+    if (io == IOMethod::DMABuf) sync_dmabuf(frame_buffer.dmabuf, DMA_BUF_SYNC_START);
+
+    lease = FrameLease(this, buffer.index, frame_buffer.start, buffer.bytesused);
+    lease.device = id;
+    lease.sequence = buffer.sequence;
+    if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        lease.timestamp_ns = buffer.timestamp.tv_sec * 1000000000LL + buffer.timestamp.tv_usec * 1000LL;
+    }
+    return true;
+}
+
+bool WebCamera::read_frame(FrameLease &lease) {
+    std::unique_lock<std::mutex> lock(buffers_mutex);
+
+    uint32_t index = 0;
+    while (index < buffers.size() && buffers[index].leased) ++index;
+    if (index == buffers.size()) {
+        throw std::runtime_error("Every capture buffer is leased, release frames before reading more");
+    }
+
+    // Reserved while read() runs without the lock
+    FrameBuffer &frame_buffer = buffers[index];
+    frame_buffer.leased = true;
+    lock.unlock();
+
+    ssize_t size;
+    {
+        metrics::ScopedTimer timer(capture_metrics().dqbuf);
+        size = ::read(descriptor, frame_buffer.start, frame_buffer.size);
+    }
+
+    if (size < 0) {
+        int error = errno;
+        lock.lock();
+        frame_buffer.leased = false;
+
+        if (error == EAGAIN || error == EINTR) return false;
+        throw std::runtime_error("Failed to read frame");
+    }
 
-        Frame frame(buffers[buffer.index].start, buffer.bytesused);
+    capture_metrics().frames.add();
+    capture_metrics().bytes.add(size);
 
-        if (ioctl(descriptor, VIDIOC_QBUF, &buffer) < 0) {
-            throw std::runtime_error("Cannot queue buffer");
+    // read() carries no driver timestamp, the time it returned is close enough
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    lease = FrameLease(this, index, frame_buffer.start, size);
+    lease.device = id;
+    lease.timestamp_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    // read() reports no driver sequence, frames are numbered as they are read
+    lease.sequence = ++last_sequence;
+    return true;
+}
+
+FrameLease WebCamera::borrow_frame() {
+    FrameLease lease;
+    while (!dequeue(lease)) {
+        // Only a non-blocking descriptor gets here
+        pollfd fd{};
+        fd.fd = descriptor;
+        fd.events = POLLIN;
+
+        if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+            throw std::runtime_error("Cannot wait for a frame");
+        }
+    }
+    return lease;
+}
+
+bool WebCamera::try_borrow(FrameLease &lease) {
+    if (!nonblocking && !frame_ready()) return false;
+    return dequeue(lease);
+}
+
+void WebCamera::watch(Reactor &reactor, std::function<void(FrameLease)> on_frame) {
+    reactor.add(descriptor, EPOLLIN, [this, on_frame] (uint32_t) {
+        // Take every buffer the driver has filled, not one per wake-up, on_frame may stop the stream
+        FrameLease lease;
+        while (state == State::StreamON && try_borrow(lease)) {
+            on_frame(std::move(lease));
         }
+    });
+}
+
+void WebCamera::requeue(uint32_t index) {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
 
-        return frame;
+    FrameBuffer &frame_buffer = buffers[index];
+    frame_buffer.leased = false;
+    if (io == IOMethod::DMABuf) sync_dmabuf(frame_buffer.dmabuf, DMA_BUF_SYNC_END);
+
+    // STREAMOFF already took every buffer back, start() will queue them again
+    if (state != State::StreamON) return;
+
+    queue(index);
+}
+
+Frame WebCamera::take(FrameLease &&lease) {
+    FrameLease held = std::move(lease);
+    // A whole pool buffer would outweigh a JPEG many times, those are copied
+    if (held.source != this || io != IOMethod::UserPtr || is_compressed(format.pixel_format)) {
+        return FrameSource::take(std::move(held));
+    }
+
+    Frame frame;
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        FrameBuffer &frame_buffer = buffers[held.index];
+
+        // The buffer changes hands, the slot gets a fresh one before release() queues it again
+        uint8_t *fresh = frame_pool.acquire(frame_buffer.size);
+        if (fresh) {
+            frame = Frame::adopt(&frame_pool, frame_buffer.start, held.size);
+            frame.pixel_format = format.pixel_format;
+            frame.timestamp_ns = held.timestamp_ns;
+            frame.sequence = held.sequence;
+            frame_buffer.start = fresh;
+        }
     }
 
-    throw std::runtime_error("Unsupported io method");
+    if (frame.data == nullptr) return FrameSource::take(std::move(held));
+
+    held.release();
+    return frame;
+}
+
+bool WebCamera::frame_ready() {
+    pollfd fd{};
+    fd.fd = descriptor;
+    fd.events = POLLIN;
+
+    return poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN);
 }
 
 }
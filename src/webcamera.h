@@ -1,41 +1,153 @@
 #pragma once
 
 #include <frame.h>
+#include <frame_source.h>
+#include <reactor.h>
+#include <linux/videodev2.h>
+#include <functional>
 #include <cstddef>
+#include <cstdint>
+#include <string>
 #include <vector>
+#include <mutex>
 
 
 namespace my {
 
-struct WebCamera {
+struct WebCamera : FrameSource {
+    /*
+     *  How frames get from the driver into memory, tried in order
+     *  DMABuf/UserPtr -> MMAP -> Read until the driver accepts one.
+     */
+    enum class IOMethod {
+        Read,     // read() copies every frame, works without streaming I/O
+        MMAP,     // driver buffers mapped into the process
+        UserPtr,  // driver captures into page-aligned frame_pool buffers
+        DMABuf,   // driver captures into imported dma-buf descriptors
+    };
+
     struct FrameBuffer {
         uint8_t *start{nullptr};
         size_t size{0};
+        bool leased{false};  // held by a FrameLease, start() must not queue it
+
+        FramePool *pool{nullptr};  // owner of start, mmap'ed if nullptr
+        int dmabuf{-1};            // imported or exported dma-buf, closed with the buffer
 
-        FrameBuffer(uint8_t *data, size_t size);
+        FrameBuffer(uint8_t *data, size_t size, FramePool *pool = nullptr);
         FrameBuffer(const FrameBuffer&) = delete;
         FrameBuffer(FrameBuffer&&);
         ~FrameBuffer();
     };
 
-    enum class State {
-        StreamOFF,
-        StreamON,
+    /* One format, size and frame interval the device advertises */
+    struct Mode {
+        uint32_t pixel_format{0};
+        uint32_t width{0};
+        uint32_t height{0};
+        uint32_t interval_numerator{1};
+        uint32_t interval_denominator{30};
+    };
+
+    /* What auto_configure() may choose from */
+    struct Requirements {
+        uint32_t max_width{UINT32_MAX};    // output size of the encoder, capturing more is waste
+        uint32_t max_height{UINT32_MAX};
+        uint32_t interval_numerator{1};    // frames must come at least this often
+        uint32_t interval_denominator{30};
+        uint64_t bandwidth{24576000};      // bytes/s of the USB link for this camera, USB 2.0 isochronous max
+        std::vector<uint32_t> pixel_formats{V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_MJPEG};  // preferred first
     };
 
+    // Buffers handed out as FrameLease point straight into the capture memory
+    using FrameLease = my::FrameLease;
+
     int descriptor = 0;
     std::vector<FrameBuffer> buffers;
-    State state = State::StreamOFF;
 
-    ~WebCamera();
+    // Chosen by init_buffers()
+    IOMethod io = IOMethod::MMAP;
+    // Device capabilities from VIDIOC_QUERYCAP
+    uint32_t capabilities = 0;
+    // Every mode from VIDIOC_ENUM_FMT/FRAMESIZES/FRAMEINTERVALS, filled by open()
+    std::vector<Mode> modes;
+
+    // V4L2 sequence of the last dequeued buffer, -1 right after start()
+    int64_t last_sequence = -1;
+
+    // Leases are released from other threads while capture starts and stops
+    std::mutex buffers_mutex;
+
+    // Opened with O_NONBLOCK, DQBUF returns EAGAIN instead of waiting
+    bool nonblocking = false;
+    // Copied to every lease, tells cameras of a group apart
+    uint32_t id = 0;
 
-    void open(const char *device);
-    void init_buffers(size_t n);
+    ~WebCamera() override;
 
-    void start();
-    void stop();
+    void open(const char *device, bool nonblocking = false);
+    /*
+     *  Asks for width x height in the first of pixel_formats (V4L2 fourccs)
+     *  the device delivers, false if it has none of them. Compressed
+     *  formats such as V4L2_PIX_FMT_MJPEG reach resolutions a USB 2.0 link
+     *  cannot carry as YUYV. Call before init_buffers().
+     */
+    bool set_format(uint32_t width, uint32_t height, const std::vector<uint32_t> &pixel_formats);
+    /*
+     *  Picks the largest mode from the cached table that meets requirements
+     *  and applies it with VIDIOC_S_FMT and VIDIOC_S_PARM, the slowest frame
+     *  interval that is fast enough keeps the bus load down. False, leaving
+     *  the format alone, if no mode fits. Call before init_buffers().
+     */
+    bool auto_configure(const Requirements &requirements);
+    // Sets time per frame with VIDIOC_S_PARM, the driver may round it
+    void set_interval(uint32_t numerator, uint32_t denominator);
+    /*
+     *  Asks the driver for n buffers, more buffers ride out longer consumer
+     *  stalls. Methods the driver refuses fall back towards MMAP and read().
+     *  DMABuf imports dmabufs, one per buffer; the camera keeps duplicates.
+     *  DMABuf is for callers that own the descriptors (a GPU or encoder
+     *  allocator), device specs cannot ask for it.
+     */
+    void init_buffers(size_t n, IOMethod method = IOMethod::MMAP, const std::vector<int> &dmabufs = {});
 
-    Frame get_frame();
+    // Exports an MMAP buffer as a dma-buf (VIDIOC_EXPBUF), the camera keeps the descriptor
+    int export_buffer(uint32_t index);
+
+    void start() override;
+    void stop() override;
+
+    FrameLease borrow_frame() override;
+    bool frame_ready() override;
+    bool try_borrow(FrameLease &lease) override;
+    void requeue(uint32_t index) override;
+    size_t buffer_count() const override { return buffers.size(); }
+    // With UserPtr the frame keeps the lease's buffer and the driver gets a fresh one
+    Frame take(FrameLease &&lease) override;
+
+    /*
+     *  Registers the device in the reactor, every filled buffer is handed to
+     *  on_frame as soon as the descriptor becomes readable.
+     */
+    void watch(Reactor &reactor, std::function<void(FrameLease)> on_frame);
+
+private:
+    void enumerate_modes();
+    bool dequeue(FrameLease &lease);
+    bool read_frame(FrameLease &lease);
+    void queue(uint32_t index);
+    void release_buffers();
 };
 
+const char *io_method_cstr(WebCamera::IOMethod method);
+
+/* Device spec "/dev/videoN[:WxH][:read|mmap|userptr]" taken apart, DMABuf is API-only */
+struct CameraSpec {
+    std::string device;
+    WebCamera::IOMethod io{WebCamera::IOMethod::MMAP};
+    WebCamera::Requirements requirements;  // only the size comes from the spec
+};
+
+CameraSpec parse_camera_spec(const std::string &spec);
+
 }
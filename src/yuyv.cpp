@@ -0,0 +1,328 @@
+#include <yuyv.h>
+#include <logging.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YUYV_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace my {
+namespace yuyv {
+
+/*
+ *  Row kernels. Every row function converts `width` pixels of one source row,
+ *  row_420 additionally averages chroma of two source rows.
+ */
+
+static void row_422_scalar(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width) {
+    for (int x = 0; x < width; x += 2) {
+        *y++ = *src++;
+        *u++ = *src++;
+        *y++ = *src++;
+        *v++ = *src++;
+    }
+}
+
+static void row_420_scalar(const uint8_t *src0, const uint8_t *src1,
+                           uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width) {
+    for (int x = 0; x < width; x += 2) {
+        *y0++ = src0[0];
+        *y1++ = src1[0];
+        *u++ = (src0[1] + src1[1] + 1) >> 1;
+        *y0++ = src0[2];
+        *y1++ = src1[2];
+        *v++ = (src0[3] + src1[3] + 1) >> 1;
+        src0 += 4;
+        src1 += 4;
+    }
+}
+
+
+#ifdef YUYV_X86
+
+/*
+ *  SSE2: 32 pixels per iteration. Luma is the low byte of every 16-bit word,
+ *  chroma the high one, so masking/shifting and packing with saturation
+ *  (values never exceed 255) splits them without shuffles.
+ */
+
+__attribute__((target("sse2")))
+static inline void block_sse2(const uint8_t *src, __m128i &y0, __m128i &y1, __m128i &u, __m128i &v) {
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+
+    __m128i a = _mm_loadu_si128((const __m128i*)(src +  0));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+
+    y0 = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    y1 = _mm_packus_epi16(_mm_and_si128(c, mask), _mm_and_si128(d, mask));
+
+    __m128i uv0 = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    __m128i uv1 = _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_srli_epi16(d, 8));
+
+    u = _mm_packus_epi16(_mm_and_si128(uv0, mask), _mm_and_si128(uv1, mask));
+    v = _mm_packus_epi16(_mm_srli_epi16(uv0, 8), _mm_srli_epi16(uv1, 8));
+}
+
+__attribute__((target("sse2")))
+static void row_422_sse2(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width) {
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m128i y0, y1, cb, cr;
+        block_sse2(src + 2 * x, y0, y1, cb, cr);
+
+        _mm_storeu_si128((__m128i*)(y + x), y0);
+        _mm_storeu_si128((__m128i*)(y + x + 16), y1);
+        _mm_storeu_si128((__m128i*)(u + x / 2), cb);
+        _mm_storeu_si128((__m128i*)(v + x / 2), cr);
+    }
+    row_422_scalar(src + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("sse2")))
+static void row_420_sse2(const uint8_t *src0, const uint8_t *src1,
+                         uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width) {
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m128i a0, a1, cb0, cr0;
+        __m128i b0, b1, cb1, cr1;
+        block_sse2(src0 + 2 * x, a0, a1, cb0, cr0);
+        block_sse2(src1 + 2 * x, b0, b1, cb1, cr1);
+
+        _mm_storeu_si128((__m128i*)(y0 + x), a0);
+        _mm_storeu_si128((__m128i*)(y0 + x + 16), a1);
+        _mm_storeu_si128((__m128i*)(y1 + x), b0);
+        _mm_storeu_si128((__m128i*)(y1 + x + 16), b1);
+        _mm_storeu_si128((__m128i*)(u + x / 2), _mm_avg_epu8(cb0, cb1));
+        _mm_storeu_si128((__m128i*)(v + x / 2), _mm_avg_epu8(cr0, cr1));
+    }
+    row_420_scalar(src0 + 2 * x, src1 + 2 * x, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x);
+}
+
+
+/*
+ *  SSSE3: one byte shuffle sorts 8 pixels into [Y x8 | U x4 | V x4],
+ *  the rest is 64/32-bit unpacking.
+ */
+
+__attribute__((target("ssse3")))
+static inline void block_ssse3(const uint8_t *src, __m128i &y0, __m128i &y1, __m128i &u, __m128i &v) {
+    const __m128i order = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 5, 9, 13, 3, 7, 11, 15);
+
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src +  0)), order);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 16)), order);
+    __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 32)), order);
+    __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 48)), order);
+
+    y0 = _mm_unpacklo_epi64(a, b);
+    y1 = _mm_unpacklo_epi64(c, d);
+
+    // [Ua Va Ub Vb] -> [Ua Ub Va Vb] in 32-bit lanes
+    __m128i uv0 = _mm_shuffle_epi32(_mm_unpackhi_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i uv1 = _mm_shuffle_epi32(_mm_unpackhi_epi64(c, d), _MM_SHUFFLE(3, 1, 2, 0));
+
+    u = _mm_unpacklo_epi64(uv0, uv1);
+    v = _mm_unpackhi_epi64(uv0, uv1);
+}
+
+__attribute__((target("ssse3")))
+static void row_422_ssse3(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width) {
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m128i y0, y1, cb, cr;
+        block_ssse3(src + 2 * x, y0, y1, cb, cr);
+
+        _mm_storeu_si128((__m128i*)(y + x), y0);
+        _mm_storeu_si128((__m128i*)(y + x + 16), y1);
+        _mm_storeu_si128((__m128i*)(u + x / 2), cb);
+        _mm_storeu_si128((__m128i*)(v + x / 2), cr);
+    }
+    row_422_scalar(src + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("ssse3")))
+static void row_420_ssse3(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width) {
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m128i a0, a1, cb0, cr0;
+        __m128i b0, b1, cb1, cr1;
+        block_ssse3(src0 + 2 * x, a0, a1, cb0, cr0);
+        block_ssse3(src1 + 2 * x, b0, b1, cb1, cr1);
+
+        _mm_storeu_si128((__m128i*)(y0 + x), a0);
+        _mm_storeu_si128((__m128i*)(y0 + x + 16), a1);
+        _mm_storeu_si128((__m128i*)(y1 + x), b0);
+        _mm_storeu_si128((__m128i*)(y1 + x + 16), b1);
+        _mm_storeu_si128((__m128i*)(u + x / 2), _mm_avg_epu8(cb0, cb1));
+        _mm_storeu_si128((__m128i*)(v + x / 2), _mm_avg_epu8(cr0, cr1));
+    }
+    row_420_scalar(src0 + 2 * x, src1 + 2 * x, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x);
+}
+
+
+/*
+ *  AVX2: the SSE2 scheme on 64 pixels. 256-bit packs work per 128-bit lane,
+ *  so every pack is followed by a qword permute to restore linear order.
+ */
+
+__attribute__((target("avx2")))
+static inline __m256i pack_avx2(__m256i a, __m256i b) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2")))
+static inline void block_avx2(const uint8_t *src, __m256i &y0, __m256i &y1, __m256i &u, __m256i &v) {
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+
+    __m256i a = _mm256_loadu_si256((const __m256i*)(src +  0));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+
+    y0 = pack_avx2(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+    y1 = pack_avx2(_mm256_and_si256(c, mask), _mm256_and_si256(d, mask));
+
+    __m256i uv0 = pack_avx2(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+    __m256i uv1 = pack_avx2(_mm256_srli_epi16(c, 8), _mm256_srli_epi16(d, 8));
+
+    u = pack_avx2(_mm256_and_si256(uv0, mask), _mm256_and_si256(uv1, mask));
+    v = pack_avx2(_mm256_srli_epi16(uv0, 8), _mm256_srli_epi16(uv1, 8));
+}
+
+__attribute__((target("avx2")))
+static void row_422_avx2(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width) {
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        __m256i y0, y1, cb, cr;
+        block_avx2(src + 2 * x, y0, y1, cb, cr);
+
+        _mm256_storeu_si256((__m256i*)(y + x), y0);
+        _mm256_storeu_si256((__m256i*)(y + x + 32), y1);
+        _mm256_storeu_si256((__m256i*)(u + x / 2), cb);
+        _mm256_storeu_si256((__m256i*)(v + x / 2), cr);
+    }
+    row_422_ssse3(src + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static void row_420_avx2(const uint8_t *src0, const uint8_t *src1,
+                         uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int width) {
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        __m256i a0, a1, cb0, cr0;
+        __m256i b0, b1, cb1, cr1;
+        block_avx2(src0 + 2 * x, a0, a1, cb0, cr0);
+        block_avx2(src1 + 2 * x, b0, b1, cb1, cr1);
+
+        _mm256_storeu_si256((__m256i*)(y0 + x), a0);
+        _mm256_storeu_si256((__m256i*)(y0 + x + 32), a1);
+        _mm256_storeu_si256((__m256i*)(y1 + x), b0);
+        _mm256_storeu_si256((__m256i*)(y1 + x + 32), b1);
+        _mm256_storeu_si256((__m256i*)(u + x / 2), _mm256_avg_epu8(cb0, cb1));
+        _mm256_storeu_si256((__m256i*)(v + x / 2), _mm256_avg_epu8(cr0, cr1));
+    }
+    row_420_ssse3(src0 + 2 * x, src1 + 2 * x, y0 + x, y1 + x, u + x / 2, v + x / 2, width - x);
+}
+
+#endif // YUYV_X86
+
+
+/*
+ *  Plane walkers shared by all instruction sets.
+ */
+
+using Row422 = void (*)(const uint8_t *, uint8_t *, uint8_t *, uint8_t *, int);
+using Row420 = void (*)(const uint8_t *, const uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint8_t *, int);
+
+template <Row422 row>
+static void convert_422(const uint8_t *src, int src_linesize, int width, int height,
+                        uint8_t *const dst[3], const int linesize[3]) {
+    for (int y = 0; y < height; ++y) {
+        row(src + y * src_linesize,
+            dst[0] + y * linesize[0],
+            dst[1] + y * linesize[1],
+            dst[2] + y * linesize[2],
+            width);
+    }
+}
+
+template <Row422 row_single, Row420 row>
+static void convert_420(const uint8_t *src, int src_linesize, int width, int height,
+                        uint8_t *const dst[3], const int linesize[3]) {
+    int y = 0;
+    for (; y + 2 <= height; y += 2) {
+        row(src + y * src_linesize,
+            src + (y + 1) * src_linesize,
+            dst[0] + y * linesize[0],
+            dst[0] + (y + 1) * linesize[0],
+            dst[1] + (y / 2) * linesize[1],
+            dst[2] + (y / 2) * linesize[2],
+            width);
+    }
+
+    // Odd height: the last chroma row comes from a single source row
+    if (y < height) {
+        row_single(src + y * src_linesize,
+                   dst[0] + y * linesize[0],
+                   dst[1] + (y / 2) * linesize[1],
+                   dst[2] + (y / 2) * linesize[2],
+                   width);
+    }
+}
+
+
+static const Kernels scalar_kernels = {
+    "scalar",
+    convert_422<row_422_scalar>,
+    convert_420<row_422_scalar, row_420_scalar>,
+};
+
+#ifdef YUYV_X86
+static const Kernels sse2_kernels = {
+    "sse2",
+    convert_422<row_422_sse2>,
+    convert_420<row_422_sse2, row_420_sse2>,
+};
+
+static const Kernels ssse3_kernels = {
+    "ssse3",
+    convert_422<row_422_ssse3>,
+    convert_420<row_422_ssse3, row_420_ssse3>,
+};
+
+static const Kernels avx2_kernels = {
+    "avx2",
+    convert_422<row_422_avx2>,
+    convert_420<row_422_avx2, row_420_avx2>,
+};
+#endif
+
+
+std::vector<const Kernels*> supported_kernels() {
+    std::vector<const Kernels*> result{&scalar_kernels};
+
+#ifdef YUYV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))  result.push_back(&sse2_kernels);
+    if (__builtin_cpu_supports("ssse3")) result.push_back(&ssse3_kernels);
+    if (__builtin_cpu_supports("avx2"))  result.push_back(&avx2_kernels);
+#endif
+
+    return result;
+}
+
+const Kernels &kernels() {
+    static const Kernels &selected = [] () -> const Kernels& {
+        const Kernels &best = *supported_kernels().back();
+        LOG_INFO << "YUYV conversion uses " << best.name << " kernels";
+        return best;
+    }();
+
+    return selected;
+}
+
+}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace my {
+namespace yuyv {
+
+/*
+ *  Deinterleaves packed YUYV ([Y U Y V] - two pixels) into planar YUV.
+ *
+ *  src_linesize is the distance in bytes between source rows, dst/linesize
+ *  are the planes and strides of the destination, exactly as in AVFrame,
+ *  so padding at the end of the rows is respected. Width must be even.
+ *
+ *  to_yuv420p averages chroma of every two rows, rounding up, the same way
+ *  as (a + b + 1) >> 1.
+ */
+using Kernel = void (*)(const uint8_t *src, int src_linesize, int width, int height,
+                        uint8_t *const dst[3], const int linesize[3]);
+
+struct Kernels {
+    const char *name;
+    Kernel to_yuv422p;
+    Kernel to_yuv420p;
+};
+
+/* Fastest implementation supported by this CPU, chosen on the first call */
+const Kernels &kernels();
+
+/* Every implementation this CPU can run, the scalar reference comes first */
+std::vector<const Kernels*> supported_kernels();
+
+inline void to_yuv422p(const uint8_t *src, int src_linesize, int width, int height,
+                       uint8_t *const dst[3], const int linesize[3]) {
+    kernels().to_yuv422p(src, src_linesize, width, height, dst, linesize);
+}
+
+inline void to_yuv420p(const uint8_t *src, int src_linesize, int width, int height,
+                       uint8_t *const dst[3], const int linesize[3]) {
+    kernels().to_yuv420p(src, src_linesize, width, height, dst, linesize);
+}
+
+}
+}